@@ -7,592 +7,3326 @@
  *
  */
 
+#define _GNU_SOURCE
+
 #include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include <inttypes.h>
 #include <math.h>
-#include <regex.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 #include "argparse.h"
 
 #define MAX_LINE_LENGTH (4096)
 #define MAX_NAME_LENGTH (128)
+#define PININFO_WRAP_COLUMN (80)
+#define MODULE_IMAGE_MAGIC "SOCMIDX"
+#define MODULE_IMAGE_VERSION (1)
+#define MODULE_IMAGE_SUFFIX ".idx"
+#define INPUT_CHUNK_SIZE (1 << 20)
+#define LINE_HEADER_SLOTS (16)
+#define ARENA_BLOCK_SIZE (1 << 20)
+#define WRITE_IOV_COUNT (1024)
+#define STREAM_BUFFER_SIZE (1 << 20)
+#define FIX_CHUNK_LINES (16384)
+
+/* Block of an arena, allocations are carved from data front to back */
+struct arena_block {
+    struct arena_block *next;/* Previously filled block */
+    size_t size;             /* Number of bytes in data */
+    size_t used;             /* Number of bytes handed out */
+    char data[];             /* Storage */
+};
+
+/* Bump allocator owning rewritten lines or parsed modules, released all at once */
+struct arena {
+    struct arena_block *head;/* Block allocations are carved from */
+};
+
+/* Structure for a line in the line list */
+struct line_entry {
+    const char *line;        /* Pointer to the line text, not null-terminated */
+    size_t length;           /* Length of the line text */
+};
+
+/*
+ * Contiguous list of lines, in output order.
+ * The array keeps LINE_HEADER_SLOTS free entries in front of the first line so
+ * that prepending a header line only moves the first index.
+ */
+struct line_list {
+    struct line_entry *entries; /* Array holding the lines from index first on */
+    size_t first;               /* Index of the first line */
+    size_t count;               /* Number of lines */
+    size_t capacity;            /* Number of entries allocated */
+    struct arena arena;         /* Storage of every line that is not a view */
+};
+
+/* A distinct name of a string pool */
+struct pool_name {
+    const char *text;        /* The name, null-terminated */
+    size_t length;           /* Length of the name */
+    size_t id;               /* Number of distinct names interned before this one */
+    struct pool_name *next;  /* Next name in id order */
+};
 
-/* Structure for a node in the linked list */
-struct line_node {
-    char *line;              /* Pointer to the string */
-    struct line_node *next;  /* Pointer to the next node */
+/* A slot of a string pool */
+struct pool_slot {
+    uint64_t hash;           /* Hash of the name, 0 for an empty slot */
+    struct pool_name *name;  /* The name */
+};
+
+/* Interning pool storing each distinct name once, so that equal names share one pool_name */
+struct string_pool {
+    struct pool_slot *slots; /* Table of mask + 1 slots, at most half full, NULL while empty */
+    size_t mask;             /* Number of slots minus one */
+    size_t count;            /* Number of distinct names */
+    struct pool_name *first; /* Names in id order */
+    struct pool_name *last;  /* Last name interned */
+    struct arena *arena;     /* Storage of the names */
 };
 
 /* Linked list structure for port information */
 struct port_node {
-    char *port_name;         /* Name of the port */
+    const struct pool_name *port_name; /* Name of the port */
     char direction;          /* 'I': in, 'O': out, 'B': inout */
     struct port_node *next;  /* Pointer to the next node */
 };
 
 /* Linked list structure for module information */
 struct module_node {
-    char *module_name;       /* Name of the module */
+    const struct pool_name *module_name; /* Name of the module */
     struct port_node *ports; /* Linked list of port information */
     struct module_node *next;/* Pointer to the next node */
 };
 
-/* Converts an SI unit string to a double */
-double si_to_double(const char *si_str) {
+/*
+ * Header of a compiled module index image. The image holds no pointers, so it can
+ * be mapped from a sidecar file as is: the header is followed by the slots, the
+ * module records, the port records and the strings the records point into by offset.
+ */
+struct module_image_header {
+    char magic[8];           /* MODULE_IMAGE_MAGIC */
+    uint32_t version;        /* MODULE_IMAGE_VERSION */
+    uint32_t byte_order;     /* 0x01020304 in the byte order of the writer */
+    uint64_t source_size;    /* Size of the soc_mod file the image was compiled from */
+    int64_t source_mtime_sec;/* Modification time of that file, seconds */
+    int64_t source_mtime_nsec; /* Modification time of that file, nanoseconds */
+    uint64_t source_hash;    /* Hash of the contents of that file */
+    uint64_t slot_count;     /* Number of slots, a power of two */
+    uint64_t module_count;   /* Number of module records */
+    uint64_t port_count;     /* Number of port records */
+    uint64_t string_size;    /* Number of bytes of strings, padded to 8 */
+};
+
+/* A slot of the module index */
+struct module_slot {
+    uint64_t hash;           /* Hash of the module name, 0 for an empty slot */
+    uint64_t module;         /* Index of the module record with that name */
+};
+
+/* A module of the index */
+struct module_record {
+    uint64_t name;           /* Offset of the name in the strings */
+    uint64_t pininfo;        /* Offset of the *.PININFO line in the strings */
+    uint32_t name_length;    /* Length of the name */
+    uint32_t pininfo_length; /* Length of the PININFO line, 0 without ports */
+    uint32_t first_port;     /* Index of the first port record */
+    uint32_t port_count;     /* Number of ports */
+};
+
+/* A port of the index */
+struct port_record {
+    uint64_t name;           /* Offset of the name in the strings */
+    uint32_t name_length;    /* Length of the name */
+    uint32_t direction;      /* 'I': in, 'O': out, 'B': inout */
+};
+
+/* A slot of a name set */
+struct name_slot {
+    uint64_t hash;           /* Hash of the name, 0 for an empty slot */
+    const char *name;        /* The name, not null-terminated */
+    size_t length;           /* Length of the name */
+    size_t value;            /* Data of the caller, 0 when the name is added */
+};
+
+/* Open-addressing hash set of names viewing text that outlives the set, probed linearly */
+struct name_set {
+    struct name_slot *slots; /* Table of mask + 1 slots, at most half full, NULL while empty */
+    size_t mask;             /* Number of slots minus one */
+    size_t count;            /* Number of names */
+};
+
+/* Open-addressing hash table of the modules by name, probed linearly, over an image */
+struct module_index {
+    const struct module_slot *slots;     /* Table of mask + 1 slots, at most half full */
+    size_t mask;                         /* Number of slots minus one, a power of two minus one */
+    const struct module_record *modules; /* Module records */
+    const struct port_record *ports;     /* Port records */
+    const char *strings;                 /* Names and PININFO lines, each null-terminated */
+    size_t module_count;                 /* Number of module records */
+    size_t port_count;                   /* Number of port records */
+    size_t string_size;                  /* Number of bytes of strings */
+    void *image;                         /* Image the tables live in, NULL before loading */
+    size_t image_size;                   /* Size of the image */
+    bool mapped;                         /* Whether the image is released with munmap rather than free */
+};
+
+/* Exact powers of ten, for the conversions that need no rounding beyond one division */
+static const double powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+#define MAX_EXACT_POWER_OF_TEN (22)
+#define MAX_MANTISSA_DIGITS (19)
+
+/* SPICE scale factors by first letter, as powers of ten, 0 for letters that are not one */
+static const signed char si_scale_exponents[256] = {
+    ['T'] = 12, ['t'] = 12, ['G'] = 9, ['g'] = 9, ['K'] = 3, ['k'] = 3,
+    ['M'] = -3, ['m'] = -3, ['U'] = -6, ['u'] = -6, ['N'] = -9, ['n'] = -9,
+    ['P'] = -12, ['p'] = -12, ['F'] = -15, ['f'] = -15, ['A'] = -18, ['a'] = -18,
+};
+
+/* Function to check for an ASCII letter without going through the locale */
+static inline bool is_ascii_letter(char c) {
+    return (c | 0x20) >= 'a' && (c | 0x20) <= 'z';
+}
+
+/* Function to check for an ASCII digit */
+static inline bool is_ascii_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+/*
+ * Converts a SPICE number of at most length bytes to a double, e.g. "1.5u", "10meg".
+ * The mantissa digits and the exponent are gathered as integers, and the scale
+ * factor is resolved from its first letter through si_scale_exponents, "meg" and
+ * "mil" being told apart from "m" by the next two letters. Scale factors are case
+ * insensitive as in SPICE, and the letters following them, such as the "m" of
+ * "10um", are ignored. The decimal point is always '.': the usual short numbers
+ * are converted without the C library, and the rare ones it gets are read in the
+ * C locale the program runs in.
+ * Stores the number of bytes read in *consumed and returns the value, or returns
+ * NAN with *consumed set to 0 if the text does not start with a number.
+ */
+double si_to_double(const char *str, size_t length, size_t *consumed) {
+    const char *p = str;
+    const char *end = str + length;
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool negative = false, any_digit = false, truncated = false;
+
+    if (p < end && (*p == '+' || *p == '-')) {
+        negative = *p++ == '-';
+    }
+
+    /* Integer and fraction digits, keeping the first MAX_MANTISSA_DIGITS significant ones */
+    for (bool fraction = false; p < end; p++) {
+        if (*p == '.' && !fraction) {
+            fraction = true;
+            continue;
+        }
+        if (!is_ascii_digit(*p)) {
+            break;
+        }
+        any_digit = true;
+        int digit = *p - '0';
+        if (digits < MAX_MANTISSA_DIGITS) {
+            if (mantissa || digit) {
+                mantissa = mantissa * 10 + digit;
+                digits++;
+            }
+            exponent -= fraction;
+        } else {
+            truncated |= digit != 0;
+            exponent += !fraction;
+        }
+    }
+    if (!any_digit) {
+        *consumed = 0;
+        return NAN;
+    }
+    const char *mantissa_end = p;
+    int written_exponent = 0;
+
+    /* Exponent, only when digits follow the 'e' */
+    if (p < end && (*p | 0x20) == 'e') {
+        const char *q = p + 1;
+        bool exponent_negative = false;
+        if (q < end && (*q == '+' || *q == '-')) {
+            exponent_negative = *q++ == '-';
+        }
+        if (q < end && is_ascii_digit(*q)) {
+            int value = 0;
+            for (; q < end && is_ascii_digit(*q); q++) {
+                if (value < 10000) {
+                    value = value * 10 + (*q - '0');
+                }
+            }
+            written_exponent = exponent_negative ? -value : value;
+            exponent += written_exponent;
+            p = q;
+        }
+    }
+
+    /* Scale factor, then any unit letters after it */
+    double factor = 1.0;
+    int scale = 0;
+    if (p < end && is_ascii_letter(*p)) {
+        scale = si_scale_exponents[(unsigned char)*p];
+        if (scale == -3 && end - p >= 3) {
+            if ((p[1] | 0x20) == 'e' && (p[2] | 0x20) == 'g') {
+                scale = 6;
+            } else if ((p[1] | 0x20) == 'i' && (p[2] | 0x20) == 'l') {
+                scale = 0;
+                factor = 25.4e-6;
+            }
+        }
+        while (p < end && is_ascii_letter(*p)) {
+            p++;
+        }
+    }
+    *consumed = p - str;
+
     double value;
-    char unit[3]; /* Buffer to hold SI unit, e.g., "n", "k" */
+    exponent += scale;
+    if (!truncated && mantissa < (1ULL << 53) &&
+        exponent >= -MAX_EXACT_POWER_OF_TEN && exponent <= MAX_EXACT_POWER_OF_TEN) {
+        /* Both operands are exact, so the result is correctly rounded */
+        value = exponent < 0 ? (double)mantissa / powers_of_ten[-exponent]
+                             : (double)mantissa * powers_of_ten[exponent];
+    } else {
+        /* Rare long or extreme numbers, the C library rounds them correctly */
+        char buffer[MAX_NAME_LENGTH];
+        size_t mantissa_length = mantissa_end - str;
+        if (mantissa_length + 16 > sizeof(buffer)) {
+            *consumed = 0;
+            return NAN;
+        }
+        memcpy(buffer, str, mantissa_length);
+        /* The scale factor joins the exponent so that there is a single rounding */
+        snprintf(buffer + mantissa_length, sizeof(buffer) - mantissa_length, "e%d", written_exponent + scale);
+        value = fabs(strtod(buffer, NULL));
+    }
+    return (negative ? -value : value) * factor;
+}
 
-    /* Scan the string for a double followed by a string */
-    if (sscanf(si_str, "%lf%s", &value, unit) < 1) {
-        return NAN; /* Return Not-a-Number if conversion fails */
+/* SPICE scale factors by engineering exponent, from 1e-18 to 1e12 */
+static const char *const si_suffixes[] = {
+    "a", "f", "p", "n", "u", "m", "", "k", "meg", "G", "T",
+};
+
+#define SI_SUFFIX_MIN_EXPONENT (-18)
+#define SI_SUFFIX_MAX_EXPONENT (12)
+#define MAX_SIGNIFICANT_DIGITS (17)
+#define MAX_SI_LENGTH (32)
+
+/* Powers of ten that fit in 64 bits */
+static const uint64_t integer_powers_of_ten[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL,
+    10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+    100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL,
+    1000000000000ULL, 10000000000000ULL, 100000000000000ULL, 1000000000000000ULL,
+    10000000000000000ULL, 100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL,
+};
+
+#define EXACT_DIGITS (19)
+
+/*
+ * Function to convert the decimal number digits * 10^exponent, digits holding
+ * count significant digits, back to a double, the way si_to_double reads it.
+ */
+double si_digits_value(const char *digits, int count, int exponent) {
+    uint64_t mantissa = 0;
+    for (int i = 0; i < count; i++) {
+        mantissa = mantissa * 10 + (digits[i] - '0');
+    }
+    if (mantissa < (1ULL << 53) && exponent >= -MAX_EXACT_POWER_OF_TEN && exponent <= MAX_EXACT_POWER_OF_TEN) {
+        /* Same exact conversion as si_to_double */
+        return exponent < 0 ? (double)mantissa / powers_of_ten[-exponent]
+                            : (double)mantissa * powers_of_ten[exponent];
     }
+    char buffer[MAX_SI_LENGTH];
+    snprintf(buffer, sizeof(buffer), "%" PRIu64 "e%d", mantissa, exponent);
+    return strtod(buffer, NULL);
+}
 
-    /* Map SI units to their multiplier */
-    const struct { char *unit; double multiplier; } units[] = {
-        {"y", 1e-24}, {"z", 1e-21}, {"a", 1e-18}, {"f", 1e-15}, {"p", 1e-12},
-        {"n", 1e-9}, {"u", 1e-6}, {"m", 1e-3}, {"c", 1e-2}, {"d", 1e-1},
-        {"da", 1e1}, {"h", 1e2}, {"k", 1e3}, {"M", 1e6}, {"G", 1e9},
-        {"T", 1e12}, {"P", 1e15}, {"E", 1e18}, {"Z", 1e21}, {"Y", 1e24}
-    };
+/*
+ * Function to print value rounded to count significant digits into digits.
+ * Returns the exponent of the first digit.
+ */
+int si_print_digits(double value, int count, char *digits) {
+    char text[MAX_SI_LENGTH];
+    snprintf(text, sizeof(text), "%.*e", count - 1, value);
+    digits[0] = text[0];
+    memcpy(digits + 1, text + 2, count - 1);
+    return atoi(strchr(text, 'e') + 1);
+}
+
+/*
+ * Function to replace the count digits at digits, the first one having
+ * *exponent, with the next count-digit number above or below them.
+ */
+void si_step_digits(char *digits, int count, int *exponent, bool up) {
+    int i = count - 1;
+    if (up) {
+        while (i >= 0 && digits[i] == '9') {
+            digits[i--] = '0';
+        }
+        if (i >= 0) {
+            digits[i]++;
+        } else {
+            /* 9.99 steps up to 1.00 of the next exponent */
+            digits[0] = '1';
+            (*exponent)++;
+        }
+    } else {
+        while (digits[i] == '0') {
+            digits[i--] = '9';
+        }
+        digits[i]--;
+        if (digits[0] == '0') {
+            /* 1.00 steps down to 9.99 of the previous exponent */
+            memset(digits, '9', count);
+            (*exponent)--;
+        }
+    }
+}
+
+/*
+ * Function to find the decimal digits of a positive value with snprintf.
+ * Each digit count of a binary search is printed rounded to that many digits.
+ * If that misses value, which happens at a power of two where the interval that
+ * converts back to value is narrower below it, the next digits on the other side
+ * of value are tried too.
+ * Returns the number of digits written to digits, their exponent in *exponent.
+ */
+int si_printf_digits(double value, int sig_digits, char *digits, int *exponent) {
+    if (sig_digits) {
+        *exponent = si_print_digits(value, sig_digits, digits);
+        return sig_digits;
+    }
+
+    /* Binary search for the fewest digits that round trip, more digits always do too */
+    int low = 1, high = MAX_SIGNIFICANT_DIGITS;
+    int count = high;
+    while (low <= high) {
+        int middle = (low + high) / 2;
+        char candidate[MAX_SIGNIFICANT_DIGITS];
+        int candidate_exponent = si_print_digits(value, middle, candidate);
+        double parsed = si_digits_value(candidate, middle, candidate_exponent - middle + 1);
+        if (parsed != value) {
+            si_step_digits(candidate, middle, &candidate_exponent, parsed < value);
+            parsed = si_digits_value(candidate, middle, candidate_exponent - middle + 1);
+        }
+        if (parsed == value) {
+            memcpy(digits, candidate, middle);
+            *exponent = candidate_exponent;
+            count = middle;
+            high = middle - 1;
+        } else {
+            low = middle + 1;
+        }
+    }
+    return count;
+}
+
+#ifdef __SIZEOF_INT128__
+/* Powers of five that fit in 64 bits */
+static const uint64_t powers_of_five[] = {
+    1ULL, 5ULL, 25ULL, 125ULL,
+    625ULL, 3125ULL, 15625ULL, 78125ULL,
+    390625ULL, 1953125ULL, 9765625ULL, 48828125ULL,
+    244140625ULL, 1220703125ULL, 6103515625ULL, 30517578125ULL,
+    152587890625ULL, 762939453125ULL, 3814697265625ULL, 19073486328125ULL,
+    95367431640625ULL, 476837158203125ULL, 2384185791015625ULL, 11920928955078125ULL,
+    59604644775390625ULL, 298023223876953125ULL, 1490116119384765625ULL, 7450580596923828125ULL,
+};
+
+#define POWER_OF_FIVE_COUNT (sizeof(powers_of_five) / sizeof(powers_of_five[0]))
+
+/*
+ * Function to check whether a decimal number converts back to value = m * 2^e,
+ * both scaled by 10^q * 2^shift, the number being candidate * 2^shift and value
+ * num. Half a unit in the last place of value is 5^q / 2, a quarter below a
+ * power of two, and a tie goes to the value with an even m.
+ */
+static inline bool si_exact_round_trips(uint64_t candidate, int shift, unsigned __int128 num, uint64_t m, int q) {
+    unsigned __int128 scaled = (unsigned __int128)candidate << shift;
+    bool below = scaled < num;
+    unsigned __int128 distance = below ? num - scaled : scaled - num;
+    distance *= below && m == (1ULL << 52) ? 4 : 2;
+    return distance < powers_of_five[q] || (distance == powers_of_five[q] && !(m & 1));
+}
+
+/*
+ * Function to find the decimal digits of a positive value with exact integer math.
+ * With value = m * 2^e, value * 10^q is m * 5^q / 2^shift. Choosing q so that this
+ * has 19 integer digits, both the digits and whether anything was dropped are
+ * exact in 128 bits, so every rounding to fewer digits is exact, and so is the
+ * check that the rounded number is nearer to value than to its neighbours,
+ * which is when it converts back to value. When the rounded number misses, the
+ * next one on the other side of value is checked as well, as at a power of two
+ * the interval that converts back to value is narrower below it.
+ * Returns the number of digits written to digits, their exponent in *exponent,
+ * or 0 if value is outside the range of roughly 1e-9 to 1e15 this covers.
+ */
+int si_exact_digits(double value, int sig_digits, char *digits, int *exponent) {
+    int binary_exponent;
+    uint64_t m = (uint64_t)ldexp(frexp(value, &binary_exponent), 53);
+    int e = binary_exponent - 53;
+    int decimal_exponent = (int)floor(log10(value));
+
+    /* log10 may be one off near powers of ten, the digit count tells */
+    unsigned __int128 num = 0;
+    uint64_t n = 0;
+    int q = 0, shift = 0;
+    for (int attempt = 0; ; attempt++) {
+        q = EXACT_DIGITS - 1 - decimal_exponent;
+        shift = -(e + q);
+        if (attempt > 2 || q < 0 || q >= (int)POWER_OF_FIVE_COUNT || shift <= 0 || shift >= 64) {
+            return 0;
+        }
+        num = (unsigned __int128)m * powers_of_five[q];
+        unsigned __int128 scaled = num >> shift;
+        if (scaled < integer_powers_of_ten[EXACT_DIGITS - 1]) {
+            decimal_exponent--;
+        } else if (scaled >= integer_powers_of_ten[EXACT_DIGITS]) {
+            decimal_exponent++;
+        } else {
+            n = (uint64_t)scaled;
+            break;
+        }
+    }
+    bool sticky = (num & (((unsigned __int128)1 << shift) - 1)) != 0;
+
+    /* Binary search for the fewest digits that round trip, more digits always do too */
+    int low = sig_digits ? sig_digits : 1;
+    int high = sig_digits ? sig_digits : MAX_SIGNIFICANT_DIGITS;
+    uint64_t rounded = 0;
+    int count = high;
+    while (low <= high) {
+        int middle = (low + high) / 2;
+
+        /* Round n to middle digits, ties to even */
+        uint64_t unit = integer_powers_of_ten[EXACT_DIGITS - middle];
+        uint64_t tail = n % unit, half = unit / 2;
+        uint64_t candidate_digits = n / unit;
+        if (tail > half || (tail == half && (sticky || (candidate_digits & 1)))) {
+            candidate_digits++;
+        }
+
+        bool found = sig_digits != 0;
+        if (!found) {
+            found = si_exact_round_trips(candidate_digits * unit, shift, num, m, q);
+        }
+        if (!found) {
+            /* Below a power of two the nearest digits may miss, the next ones above may not, and vice versa */
+            bool below = ((unsigned __int128)(candidate_digits * unit) << shift) < num;
+            uint64_t neighbour_digits = below ? candidate_digits + 1 : candidate_digits - 1;
+            found = si_exact_round_trips(neighbour_digits * unit, shift, num, m, q);
+            if (found) {
+                candidate_digits = neighbour_digits;
+            }
+        }
+        if (found) {
+            rounded = candidate_digits;
+            count = middle;
+            high = middle - 1;
+        } else {
+            low = middle + 1;
+        }
+    }
+
+    *exponent = decimal_exponent;
+    if (rounded == integer_powers_of_ten[count]) {
+        /* 9.99 rounded up to 10.0 */
+        rounded /= 10;
+        (*exponent)++;
+    }
+    for (int i = count - 1; i >= 0; i--) {
+        digits[i] = '0' + rounded % 10;
+        rounded /= 10;
+    }
+    return count;
+}
+#endif
+
+/*
+ * Converts a double to an SI unit string written at out, e.g. 4.2e-6 to "4.2u".
+ * With sig_digits at 0, the digits are the fewest that convert back to exactly
+ * value, otherwise value is rounded to sig_digits significant digits. The scale
+ * factor is indexed by the engineering exponent, values outside its range get
+ * an exponent instead. At most MAX_SI_LENGTH bytes are written, without a null
+ * terminator.
+ * Returns the end of the string.
+ */
+char *double_to_si(char *out, double value, int sig_digits) {
+    if (value == 0 || !isfinite(value)) {
+        return out + sprintf(out, "%g", value);
+    }
+    if (value < 0) {
+        *out++ = '-';
+        value = -value;
+    }
+
+    char digits[MAX_SIGNIFICANT_DIGITS];
+    int exponent;
+    int count = 0;
+#ifdef __SIZEOF_INT128__
+    count = si_exact_digits(value, sig_digits, digits, &exponent);
+#endif
+    if (!count) {
+        count = si_printf_digits(value, sig_digits, digits, &exponent);
+    }
+    while (count > 1 && digits[count - 1] == '0') {
+        count--;
+    }
 
-    size_t num_units = sizeof(units) / sizeof(units[0]);
-    for (size_t i = 0; i < num_units; i++) {
-        if (strcmp(units[i].unit, unit) == 0) {
-            return value * units[i].multiplier;
+    if (exponent < SI_SUFFIX_MIN_EXPONENT || exponent >= SI_SUFFIX_MAX_EXPONENT + 3) {
+        /* Beyond the scale factors, d.ddde[+-]x */
+        *out++ = digits[0];
+        if (count > 1) {
+            *out++ = '.';
+            out = mempcpy(out, digits + 1, count - 1);
+        }
+        return out + sprintf(out, "e%d", exponent);
+    }
+
+    /* Engineering exponent, the multiple of 3 at or below exponent */
+    int engineering = exponent >= 0 ? exponent / 3 * 3 : -((-exponent + 2) / 3 * 3);
+    int integer_digits = exponent - engineering + 1;
+    if (count <= integer_digits) {
+        out = mempcpy(out, digits, count);
+        memset(out, '0', integer_digits - count);
+        out += integer_digits - count;
+    } else {
+        out = mempcpy(out, digits, integer_digits);
+        *out++ = '.';
+        out = mempcpy(out, digits + integer_digits, count - integer_digits);
+    }
+    const char *suffix = si_suffixes[(engineering - SI_SUFFIX_MIN_EXPONENT) / 3];
+    return stpcpy(out, suffix);
+}
+
+/*
+ * Function to allocate size bytes from the arena.
+ * A new block is chained when the current one is full, allocations larger
+ * than ARENA_BLOCK_SIZE get a block of their own. Exits on allocation failure.
+ */
+void *arena_alloc(struct arena *arena, size_t size) {
+    struct arena_block *block = arena->head;
+    size = (size + 7) & ~(size_t)7; /* Keep every allocation 8-byte aligned */
+
+    if (!block || block->size - block->used < size) {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(struct arena_block) + block_size);
+        if (!block) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        block->next = arena->head;
+        block->size = block_size;
+        block->used = 0;
+        arena->head = block;
+    }
+
+    void *ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+/* Function to copy length bytes of text into the arena as a null-terminated string */
+char *arena_strndup(struct arena *arena, const char *text, size_t length) {
+    char *copy = arena_alloc(arena, length + 1);
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+/* Function to forget every allocation, keeping only the most recent block for reuse */
+void arena_reset(struct arena *arena) {
+    if (!arena->head) {
+        return;
+    }
+    struct arena_block *block = arena->head->next;
+    while (block) {
+        struct arena_block *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->head->next = NULL;
+    arena->head->used = 0;
+}
+
+/* Function to move every block of src into dst, dst keeps allocating from its own block */
+void arena_merge(struct arena *dst, struct arena *src) {
+    if (!src->head) {
+        return;
+    }
+    if (!dst->head) {
+        dst->head = src->head;
+    } else {
+        struct arena_block *tail = src->head;
+        while (tail->next) {
+            tail = tail->next;
+        }
+        tail->next = dst->head->next;
+        dst->head->next = src->head;
+    }
+    src->head = NULL;
+}
+
+/* Function to release all the memory held by the arena */
+void arena_release(struct arena *arena) {
+    arena_reset(arena);
+    free(arena->head);
+    arena->head = NULL;
+}
+
+/* Function to free the memory allocated for the line list and its rewritten lines */
+void free_lines(struct line_list *list) {
+    free(list->entries);
+    arena_release(&list->arena);
+    list->entries = NULL;
+    list->count = 0;
+}
+
+/* Function to check whether a line starts with prefix */
+bool line_starts_with(const struct line_entry *entry, const char *prefix) {
+    size_t prefix_len = strlen(prefix);
+    return entry->length >= prefix_len && memcmp(entry->line, prefix, prefix_len) == 0;
+}
+
+/*
+ * Function to record the line ending at offset end, if it is not empty.
+ * Shared by the line scanners, which only differ in how they find the newlines.
+ */
+static inline size_t scan_emit_line(const char *buffer, size_t start, size_t end,
+                                    struct line_entry *lines, size_t count) {
+    if (end > start) {
+        lines[count].line = buffer + start;
+        lines[count].length = end - start;
+        count++;
+    }
+    return count;
+}
+
+/* Function to count the newlines in a buffer, one byte at a time */
+size_t count_newlines_scalar(const char *buffer, size_t size) {
+    size_t count = 0;
+    for (size_t i = 0; i < size; i++) {
+        count += buffer[i] == '\n';
+    }
+    return count;
+}
+
+/*
+ * Function to split a buffer at its newlines, one byte at a time.
+ * The non-empty newline-terminated lines are stored in lines and counted in the
+ * return value; *tail is set to the offset of the text after the last newline.
+ */
+size_t split_newlines_scalar(const char *buffer, size_t size, struct line_entry *lines, size_t *tail) {
+    size_t count = 0, start = 0;
+    for (size_t i = 0; i < size; i++) {
+        if (buffer[i] == '\n') {
+            count = scan_emit_line(buffer, start, i, lines, count);
+            start = i + 1;
+        }
+    }
+    *tail = start;
+    return count;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* Function to count the newlines in a buffer, 16 bytes at a time with SSE2 */
+__attribute__((target("sse2")))
+size_t count_newlines_sse2(const char *buffer, size_t size) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+    size_t count = 0, i = 0;
+
+    while (i + 16 <= size) {
+        /* Byte counters are folded into the total before they can wrap */
+        __m128i counters = zero;
+        for (int round = 0; round < 255 && i + 16 <= size; round++, i += 16) {
+            __m128i block = _mm_loadu_si128((const __m128i *)(buffer + i));
+            counters = _mm_sub_epi8(counters, _mm_cmpeq_epi8(block, newline));
+        }
+        __m128i sums = _mm_sad_epu8(counters, zero);
+        count += (size_t)_mm_cvtsi128_si32(sums) + (size_t)_mm_extract_epi16(sums, 4);
+    }
+    return count + count_newlines_scalar(buffer + i, size - i);
+}
+
+/* Function to split a buffer at its newlines, 16 bytes at a time with SSE2 */
+__attribute__((target("sse2")))
+size_t split_newlines_sse2(const char *buffer, size_t size, struct line_entry *lines, size_t *tail) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t count = 0, start = 0, i = 0;
+
+    for (; i + 16 <= size; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(buffer + i));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+        while (mask) {
+            size_t end = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+            count = scan_emit_line(buffer, start, end, lines, count);
+            start = end + 1;
+        }
+    }
+    for (; i < size; i++) {
+        if (buffer[i] == '\n') {
+            count = scan_emit_line(buffer, start, i, lines, count);
+            start = i + 1;
+        }
+    }
+    *tail = start;
+    return count;
+}
+
+/* Function to count the newlines in a buffer, 32 bytes at a time with AVX2 */
+__attribute__((target("avx2")))
+size_t count_newlines_avx2(const char *buffer, size_t size) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i zero = _mm256_setzero_si256();
+    size_t count = 0, i = 0;
+
+    while (i + 32 <= size) {
+        /* Byte counters are folded into the total before they can wrap */
+        __m256i counters = zero;
+        for (int round = 0; round < 255 && i + 32 <= size; round++, i += 32) {
+            __m256i block = _mm256_loadu_si256((const __m256i *)(buffer + i));
+            counters = _mm256_sub_epi8(counters, _mm256_cmpeq_epi8(block, newline));
+        }
+        /* Folded through memory, 64-bit lane extracts only exist on x86-64 */
+        uint64_t sums[4];
+        _mm256_storeu_si256((__m256i *)sums, _mm256_sad_epu8(counters, zero));
+        count += (size_t)(sums[0] + sums[1] + sums[2] + sums[3]);
+    }
+    return count + count_newlines_scalar(buffer + i, size - i);
+}
+
+/* Function to split a buffer at its newlines, 32 bytes at a time with AVX2 */
+__attribute__((target("avx2")))
+size_t split_newlines_avx2(const char *buffer, size_t size, struct line_entry *lines, size_t *tail) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t count = 0, start = 0, i = 0;
+
+    for (; i + 32 <= size; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(buffer + i));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline));
+        while (mask) {
+            size_t end = i + __builtin_ctz(mask);
+            mask &= mask - 1;
+            count = scan_emit_line(buffer, start, end, lines, count);
+            start = end + 1;
+        }
+    }
+    for (; i < size; i++) {
+        if (buffer[i] == '\n') {
+            count = scan_emit_line(buffer, start, i, lines, count);
+            start = i + 1;
+        }
+    }
+    *tail = start;
+    return count;
+}
+#endif
+
+/* Newline scanner implementation, chosen once for the running CPU */
+struct line_scanner {
+    size_t (*count)(const char *buffer, size_t size);
+    size_t (*split)(const char *buffer, size_t size, struct line_entry *lines, size_t *tail);
+};
+
+/* Function to pick the widest newline scanner the CPU supports */
+const struct line_scanner *select_line_scanner(void) {
+    static const struct line_scanner scalar = { count_newlines_scalar, split_newlines_scalar };
+#if defined(__x86_64__) || defined(__i386__)
+    static const struct line_scanner sse2 = { count_newlines_sse2, split_newlines_sse2 };
+    static const struct line_scanner avx2 = { count_newlines_avx2, split_newlines_avx2 };
+
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return &avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return &sse2;
+    }
+#endif
+    return &scalar;
+}
+
+/*
+ * Function to split buffer into a list of lines.
+ * The array is sized once from a vectorized newline count, then filled by a single
+ * scan. The lines are views into buffer, which must outlive the list. Every line is
+ * followed by a readable byte, its newline, except a last line without newline
+ * which is copied into the arena. Returns 0 on success, -1 on failure.
+ */
+int split_buffer(const char *buffer, size_t size, struct line_list *list) {
+    const struct line_scanner *scanner = select_line_scanner();
+    size_t max_lines = scanner->count(buffer, size) + 1; /* The last line may lack a newline */
+
+    list->capacity = LINE_HEADER_SLOTS + max_lines;
+    list->entries = malloc(list->capacity * sizeof(struct line_entry));
+    list->first = LINE_HEADER_SLOTS;
+    list->count = 0;
+    list->arena.head = NULL;
+    if (!list->entries) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return -1;
+    }
+
+    /* Record every newline-terminated line */
+    struct line_entry *lines = list->entries + list->first;
+    size_t tail;
+    list->count = size ? scanner->split(buffer, size, lines, &tail) : 0;
+
+    /* Copy a last line without newline, so that a readable byte follows it too */
+    if (size && tail < size) {
+        lines[list->count].length = size - tail;
+        lines[list->count].line = arena_strndup(&list->arena, buffer + tail, size - tail);
+        list->count++;
+    }
+    return 0;
+}
+
+/* Buffer holding the whole input, either mapped or read into the heap */
+struct input_buffer {
+    char *data;              /* Input bytes, not null-terminated */
+    size_t size;             /* Number of input bytes */
+    bool mapped;             /* Whether data is released with munmap rather than free */
+};
+
+/*
+ * Function to map a regular file into memory for sequential reading.
+ * Returns 0 on success, or -1 if fd is not a regular file or cannot be mapped,
+ * in which case the caller has to read the input itself.
+ */
+int map_input(int fd, struct input_buffer *input) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return -1;
+    }
+
+    input->size = st.st_size;
+    input->mapped = true;
+    if (!input->size) {
+        input->data = NULL; /* Nothing to map for an empty file */
+        return 0;
+    }
+
+    /* A private writable mapping lets the lines be edited in place, pages are copied on write */
+    input->data = mmap(NULL, input->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (input->data == MAP_FAILED) {
+        return -1;
+    }
+    /* The input is walked front to back exactly once per pass */
+    madvise(input->data, input->size, MADV_SEQUENTIAL);
+    return 0;
+}
+
+/*
+ * Function to read the whole input into the heap, for input that cannot be mapped.
+ * The size is not known in advance on a pipe, so the buffer starts at INPUT_CHUNK_SIZE
+ * and doubles whenever it fills up, each read() asking for all of the free space.
+ * Returns 0 on success, -1 on a read error or memory allocation failure.
+ */
+int read_input(int fd, struct input_buffer *input) {
+    size_t capacity = INPUT_CHUNK_SIZE;
+    char *data = malloc(capacity);
+    size_t size = 0;
+    if (!data) {
+        return -1;
+    }
+
+    while (1) {
+        if (size == capacity) {
+            char *grown = realloc(data, capacity * 2);
+            if (!grown) {
+                free(data);
+                return -1;
+            }
+            data = grown;
+            capacity *= 2;
+        }
+
+        ssize_t count = read(fd, data + size, capacity - size);
+        if (count == 0) {
+            break; /* End of input */
+        }
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            free(data);
+            return -1;
+        }
+        size += count;
+    }
+
+    input->data = data;
+    input->size = size;
+    input->mapped = false;
+    return 0;
+}
+
+/* Function to release the input buffer */
+void release_input(struct input_buffer *input) {
+    if (input->mapped) {
+        if (input->data) {
+            munmap(input->data, input->size);
+        }
+    } else {
+        free(input->data);
+    }
+}
+
+/* Function to write all iovecs, resuming after partial writes. Returns 0 on success, -1 on error */
+int writev_all(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        /* Skip the iovecs written in full and trim a partially written one */
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Function to write the line list to fd straight from where the lines live.
+ * A line whose newline follows it in memory, as for views into the input, goes
+ * out as one iovec with its newline, and an iovec continuing the previous one is
+ * merged into it, so runs of unchanged lines are written as a single block.
+ * Returns 0 on success, -1 on a write error.
+ */
+int write_lines(int fd, const struct line_list *list) {
+    static const char newline = '\n';
+    struct iovec iov[WRITE_IOV_COUNT];
+    int count = 0;
+
+    for (size_t i = list->first; i < list->first + list->count; i++) {
+        const struct line_entry *entry = &list->entries[i];
+        /* Lines are always followed by a readable byte, see split_buffer */
+        bool has_newline = entry->line[entry->length] == '\n';
+        size_t length = entry->length + has_newline;
+
+        if (count && (char *)iov[count - 1].iov_base + iov[count - 1].iov_len == entry->line) {
+            iov[count - 1].iov_len += length;
+        } else {
+            if (count == WRITE_IOV_COUNT) {
+                if (writev_all(fd, iov, count) != 0) {
+                    return -1;
+                }
+                count = 0;
+            }
+            iov[count].iov_base = (void *)entry->line;
+            iov[count].iov_len = length;
+            count++;
+        }
+
+        if (!has_newline) {
+            if (count == WRITE_IOV_COUNT) {
+                if (writev_all(fd, iov, count) != 0) {
+                    return -1;
+                }
+                count = 0;
+            }
+            iov[count].iov_base = (void *)&newline;
+            iov[count].iov_len = 1;
+            count++;
+        }
+    }
+    return writev_all(fd, iov, count);
+}
+
+/* Function to insert a new line at the beginning of the list, the text must outlive the list */
+void prepend_line(struct line_list *list, const char *new_line) {
+    if (!list->first) {
+        fprintf(stderr, "No room left for header lines\n");
+        exit(1); /* Exit if the header slots are used up */
+    }
+    struct line_entry *entry = &list->entries[--list->first];
+    entry->line = new_line;
+    entry->length = strlen(new_line);
+    list->count++;
+}
+
+/* A key=value pair of a line */
+struct line_param {
+    const char *key;         /* Key text, not null-terminated */
+    size_t key_length;       /* Length of the key */
+    const char *value;       /* Value text, not null-terminated */
+    size_t value_length;     /* Length of the value */
+};
+
+/* Parameters the calculated data depends on, in cache key order */
+enum geometry_param {
+    GEOMETRY_W,
+    GEOMETRY_L,
+    GEOMETRY_FINGERS,
+    GEOMETRY_AREA,
+    GEOMETRY_PJ,
+    GEOMETRY_PARAM_COUNT,
+};
+
+/* A device statement split into its fields, every field viewing the line text */
+struct device_line {
+    const char *name;        /* First token, e.g. "MM1" */
+    size_t name_length;      /* Length of the name */
+    size_t node_count;       /* Number of tokens between the name and the model */
+    const char *model;       /* Last token before the first key=value pair, e.g. "nch" */
+    size_t model_length;     /* Length of the model */
+    struct line_param geometry[GEOMETRY_PARAM_COUNT]; /* First pair of each geometry key, key NULL if absent */
+    size_t param_count;      /* Number of key=value pairs */
+};
+
+/* Function to check whether a character separates tokens */
+static inline bool is_token_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+/* Function to check whether a line continues the statement of the line before it */
+static inline bool is_continuation(const struct line_entry *entry) {
+    return entry->length && entry->line[0] == '+';
+}
+
+/* Function to map a parameter key to its enum geometry_param, GEOMETRY_PARAM_COUNT if it is none */
+static inline enum geometry_param geometry_param_of(const char *key, size_t length) {
+    switch (length) {
+    case 1:
+        return *key == 'w' ? GEOMETRY_W : *key == 'l' ? GEOMETRY_L : GEOMETRY_PARAM_COUNT;
+    case 2:
+        return memcmp(key, "pj", 2) == 0 ? GEOMETRY_PJ : GEOMETRY_PARAM_COUNT;
+    case 4:
+        return memcmp(key, "area", 4) == 0 ? GEOMETRY_AREA : GEOMETRY_PARAM_COUNT;
+    case 7:
+        return memcmp(key, "fingers", 7) == 0 ? GEOMETRY_FINGERS : GEOMETRY_PARAM_COUNT;
+    default:
+        return GEOMETRY_PARAM_COUNT;
+    }
+}
+
+/*
+ * Function to add the fields of one line of a statement to device.
+ * A token holding an '=' is a pair, split at its first '='. The tokens before the
+ * first pair are the name, the nodes and the model, a lone "/" between the nodes
+ * and the model of an instance line being skipped. Of the pairs, only the first
+ * one of each geometry key is kept, so a statement may have any number of them.
+ */
+void tokenize_line(const char *line, size_t length, struct device_line *device) {
+    const char *p = line;
+    const char *end = line + length;
+
+    while (p < end) {
+        while (p < end && is_token_space(*p)) {
+            p++;
+        }
+        if (p == end) {
+            break;
+        }
+
+        const char *token = p;
+        const char *equal = NULL;
+        while (p < end && !is_token_space(*p)) {
+            if (*p == '=' && !equal) {
+                equal = p;
+            }
+            p++;
+        }
+        size_t token_length = p - token;
+
+        if (equal) {
+            device->param_count++;
+            enum geometry_param index = geometry_param_of(token, equal - token);
+            if (index != GEOMETRY_PARAM_COUNT && !device->geometry[index].key) {
+                struct line_param *param = &device->geometry[index];
+                param->key = token;
+                param->key_length = equal - token;
+                param->value = equal + 1;
+                param->value_length = p - (equal + 1);
+            }
+        } else if (device->param_count) {
+            continue; /* Positional tokens after the pairs belong to no field */
+        } else if (!device->name) {
+            device->name = token;
+            device->name_length = token_length;
+        } else if (token_length == 1 && *token == '/') {
+            continue; /* Separates the nodes from the model of an instance */
+        } else {
+            /* The previous model candidate turns out to be a node */
+            if (device->model) {
+                device->node_count++;
+            }
+            device->model = token;
+            device->model_length = token_length;
+        }
+    }
+}
+
+/*
+ * Function to split a statement into name, nodes, model and key=value pairs in one pass.
+ * The statement is its first line and the '+' continuation lines after it. The
+ * lines are tokenized where they are, without joining them, so fields from every
+ * line are views into their own line.
+ */
+void tokenize_statement(const struct line_entry *segments, size_t count, struct device_line *device) {
+    memset(device, 0, sizeof(*device));
+
+    for (size_t i = 0; i < count; i++) {
+        const char *line = segments[i].line;
+        size_t length = segments[i].length;
+        if (i && is_continuation(&segments[i])) {
+            line++; /* Skip the '+' */
+            length--;
+        }
+        tokenize_line(line, length, device);
+    }
+}
+
+/*
+ * Function to convert the value of a parameter.
+ * Returns true if the parameter is present and its value is a number as a whole.
+ */
+bool param_number(const struct line_param *param, double *value) {
+    if (!param) {
+        return false;
+    }
+
+    size_t consumed;
+    *value = si_to_double(param->value, param->value_length, &consumed);
+    return consumed && consumed == param->value_length;
+}
+
+#define GEOMETRY_CACHE_SIZE (4096)
+#define GEOMETRY_KEY_LENGTH (96)
+#define GEOMETRY_SUFFIX_LENGTH (3 * (MAX_SI_LENGTH + 4))
+
+/* Lookups and hits of a geometry cache */
+struct geometry_stats {
+    size_t lookups;          /* Statements looked up */
+    size_t hits;             /* Lookups that found their suffix */
+};
+
+/* A calculated suffix and the parameter text it was calculated from */
+struct geometry_entry {
+    uint64_t hash;           /* Hash of the key, 0 for an empty entry */
+    size_t key_length;       /* Length of the key */
+    char key[GEOMETRY_KEY_LENGTH]; /* Values of w, l, fingers, area and pj */
+    size_t suffix_length;    /* Length of the suffix, 0 if nothing is appended */
+    char suffix[GEOMETRY_SUFFIX_LENGTH]; /* Formatted " fw=... w=... l=..." */
+};
+
+/*
+ * Direct-mapped cache of calculated suffixes for one thread.
+ * Flattened netlists repeat the same geometry many times, so a statement whose
+ * parameter text was seen before reuses its suffix instead of converting,
+ * calculating and formatting again. A new key replaces whatever was in its slot.
+ */
+struct geometry_cache {
+    struct geometry_entry *entries; /* GEOMETRY_CACHE_SIZE entries */
+    struct geometry_stats stats;    /* Lookups and hits so far */
+};
+
+/* Function to allocate the entries of a geometry cache */
+void geometry_cache_init(struct geometry_cache *cache) {
+    cache->entries = calloc(GEOMETRY_CACHE_SIZE, sizeof(struct geometry_entry));
+    if (!cache->entries) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    cache->stats.lookups = 0;
+    cache->stats.hits = 0;
+}
+
+/* Function to free the entries of a geometry cache */
+void geometry_cache_free(struct geometry_cache *cache) {
+    free(cache->entries);
+    cache->entries = NULL;
+}
+
+/* Function to print how often the geometry cache saved a calculation */
+void print_geometry_stats(const struct geometry_stats *stats) {
+    double rate = stats->lookups ? 100.0 * stats->hits / stats->lookups : 0.0;
+    fprintf(stderr, "Geometry cache: %zu lookups, %zu hits (%.1f%%)\n", stats->lookups, stats->hits, rate);
+}
+
+/*
+ * Function to build the cache key of a statement from the raw text of its parameters.
+ * Each of w, l, fingers, area and pj adds its value and a '\0', or a '\1' when the
+ * statement does not have it, so that absent and empty values differ.
+ * Returns the key length, or 0 if the key does not fit in GEOMETRY_KEY_LENGTH.
+ */
+size_t build_geometry_key(const struct line_param *const params[], size_t count, char *key) {
+    size_t length = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t value_length = params[i] ? params[i]->value_length : 0;
+        if (length + value_length + 1 > GEOMETRY_KEY_LENGTH) {
+            return 0;
+        }
+        if (params[i]) {
+            memcpy(key + length, params[i]->value, value_length);
+            length += value_length;
+            key[length++] = '\0';
+        } else {
+            key[length++] = '\1';
+        }
+    }
+    return length;
+}
+
+/* Function to hash a key, FNV-1a, never returning 0 */
+uint64_t hash_key(const char *key, size_t length) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)key[i]) * 1099511628211ULL;
+    }
+    return hash ? hash : 1;
+}
+
+/*
+ * Function to calculate the data of a statement from its parameters, indexed by
+ * enum geometry_param, and format it into suffix.
+ * Returns the length of the suffix, 0 if there is nothing to append.
+ */
+size_t calculate_suffix(const struct line_param *const params[], int sig_digits, char *suffix) {
+    /* Initialize variables for processing */
+    double w = 0.0, l = 0.0, fw = 0.0, fingers = 1.0;
+    double area = 0.0, pj = 0.0;
+    double area_w = 0.0, area_l = 0.0;
+
+    /* Check for 'w', 'l' and 'fingers' values and calculate fw */
+    bool w_found = param_number(params[GEOMETRY_W], &w);
+    bool l_found = param_number(params[GEOMETRY_L], &l);
+    bool fingers_found = param_number(params[GEOMETRY_FINGERS], &fingers);
+    bool fw_found = w_found && l_found;
+    if (fw_found) {
+        fw = fingers_found ? (w / fingers) : w;
+        /* If fingers is 0, fw has no real value and is not appended */
+        fw_found = isfinite(fw);
+    }
+
+    /* Check for 'area' and 'pj' values and calculate w and l */
+    bool area_found = param_number(params[GEOMETRY_AREA], &area);
+    bool pj_found = param_number(params[GEOMETRY_PJ], &pj);
+    bool area_wl_found = false;
+
+    if (area_found && pj_found) {
+        /* w + l = pj / 2 and w * l = area, so w and l are the roots of a quadratic */
+        double delta = pj * pj / 4 - 4 * area;
+        /* If delta is negative, w and l are not appended */
+        if (delta >= 0) {
+            double delta_sqrt = sqrt(delta);
+            double l1 = (pj / 2 + delta_sqrt) / 2;
+            double l2 = (pj / 2 - delta_sqrt) / 2;
+
+            /* If both l1 and l2 are <= 0, w and l are not appended either */
+            if (l1 > 0 || l2 > 0) {
+                /* Calculate w1 and w2 */
+                double w1 = area / l1;
+                double w2 = area / l2;
+
+                /* If l1 is greater than or equal to w1, select l1 and w1, otherwise l2 and w2 */
+                area_l = l1 >= w1 ? l1 : l2;
+                area_w = l1 >= w1 ? w1 : w2;
+                area_wl_found = true;
+            }
+        }
+    }
+
+    /* Format the values straight into the suffix */
+    char *out = suffix;
+    if (fw_found) {
+        out = mempcpy(out, " fw=", 4);
+        out = double_to_si(out, fw, sig_digits);
+    }
+    if (area_wl_found) {
+        out = mempcpy(out, " w=", 3);
+        out = double_to_si(out, area_w, sig_digits);
+        out = mempcpy(out, " l=", 3);
+        out = double_to_si(out, area_l, sig_digits);
+    }
+    return out - suffix;
+}
+
+/*
+ * Function to process a statement of count lines. The calculated data is appended
+ * to its last line, which is the only line that gets new storage. The suffix is
+ * taken from cache when the statement has the same parameter text as one before.
+ */
+void process_statement(struct line_entry *segments, size_t count, int sig_digits,
+                       struct geometry_cache *cache, struct arena *arena) {
+    struct device_line device;
+
+    /* Split the statement once, the parameters are then read from its fields */
+    tokenize_statement(segments, count, &device);
+
+    const struct line_param *params[GEOMETRY_PARAM_COUNT];
+    for (size_t i = 0; i < GEOMETRY_PARAM_COUNT; i++) {
+        params[i] = device.geometry[i].key ? &device.geometry[i] : NULL;
+    }
+    if (!(params[GEOMETRY_W] && params[GEOMETRY_L]) && !(params[GEOMETRY_AREA] && params[GEOMETRY_PJ])) {
+        return; /* Nothing to calculate */
+    }
+
+    char local_suffix[GEOMETRY_SUFFIX_LENGTH];
+    const char *suffix = local_suffix;
+    size_t suffix_length;
+    char key[GEOMETRY_KEY_LENGTH];
+    size_t key_length = build_geometry_key(params, GEOMETRY_PARAM_COUNT, key);
+    if (key_length) {
+        uint64_t hash = hash_key(key, key_length);
+        struct geometry_entry *entry = &cache->entries[hash & (GEOMETRY_CACHE_SIZE - 1)];
+        cache->stats.lookups++;
+        if (entry->hash == hash && entry->key_length == key_length && memcmp(entry->key, key, key_length) == 0) {
+            cache->stats.hits++;
+        } else {
+            entry->hash = hash;
+            entry->key_length = key_length;
+            memcpy(entry->key, key, key_length);
+            entry->suffix_length = calculate_suffix(params, sig_digits, entry->suffix);
+        }
+        suffix = entry->suffix;
+        suffix_length = entry->suffix_length;
+    } else {
+        suffix_length = calculate_suffix(params, sig_digits, local_suffix);
+    }
+    if (!suffix_length) {
+        return;
+    }
+
+    /* Append the suffix to a copy of the last line in the arena */
+    struct line_entry *last = &segments[count - 1];
+    char *new_line = arena_alloc(arena, last->length + suffix_length + 1);
+    char *out = mempcpy(new_line, last->line, last->length);
+    out = mempcpy(out, suffix, suffix_length);
+    *out = '\0';
+    last->line = new_line;
+    last->length = out - new_line;
+}
+
+/* Function to find the end of the name starting at p, at a blank or a colon */
+static inline const char *soc_mod_name_end(const char *p, const char *end) {
+    while (p < end && *p != ':' && !isspace((unsigned char)*p)) p++;
+    return p;
+}
+
+/* Function to find the slot of a name in the set, or the empty slot it would take */
+struct name_slot *name_set_slot(const struct name_set *set, const char *name, size_t length, uint64_t hash) {
+    size_t slot = hash & set->mask;
+    while (set->slots[slot].hash && (set->slots[slot].hash != hash || set->slots[slot].length != length ||
+                                     memcmp(set->slots[slot].name, name, length) != 0)) {
+        slot = (slot + 1) & set->mask;
+    }
+    return &set->slots[slot];
+}
+
+/*
+ * Function to add a name to the set, the table doubling when half full.
+ * Returns the slot of the name, valid until the next addition. Exits on allocation failure.
+ */
+struct name_slot *name_set_add(struct name_set *set, const char *name, size_t length) {
+    if (2 * (set->count + 1) > set->mask + 1 || !set->slots) {
+        size_t size = set->slots ? 2 * (set->mask + 1) : 64;
+        struct name_set grown = { .slots = calloc(size, sizeof(struct name_slot)), .mask = size - 1, .count = set->count };
+        if (!grown.slots) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        for (size_t i = 0; set->slots && i <= set->mask; i++) {
+            if (set->slots[i].hash) {
+                *name_set_slot(&grown, set->slots[i].name, set->slots[i].length, set->slots[i].hash) = set->slots[i];
+            }
+        }
+        free(set->slots);
+        *set = grown;
+    }
+
+    uint64_t hash = hash_key(name, length);
+    struct name_slot *slot = name_set_slot(set, name, length, hash);
+    if (!slot->hash) {
+        slot->hash = hash;
+        slot->name = name;
+        slot->length = length;
+        slot->value = 0;
+        set->count++;
+    }
+    return slot;
+}
+
+/* Function to find the slot of a name in the set, NULL if the set lacks it */
+const struct name_slot *name_set_find(const struct name_set *set, const char *name, size_t length) {
+    if (!set->slots) {
+        return NULL;
+    }
+    const struct name_slot *slot = name_set_slot(set, name, length, hash_key(name, length));
+    return slot->hash ? slot : NULL;
+}
+
+/* Function to tell whether the set holds a name */
+bool name_set_contains(const struct name_set *set, const char *name, size_t length) {
+    return name_set_find(set, name, length) != NULL;
+}
+
+/* Function to free the table of a name set, the names stay */
+void free_name_set(struct name_set *set) {
+    free(set->slots);
+    set->slots = NULL;
+    set->mask = 0;
+    set->count = 0;
+}
+
+/* Function to find the slot of a name in the pool, or the empty slot it would take */
+struct pool_slot *string_pool_slot(const struct string_pool *pool, const char *text, size_t length, uint64_t hash) {
+    size_t slot = hash & pool->mask;
+    while (pool->slots[slot].hash && (pool->slots[slot].hash != hash || pool->slots[slot].name->length != length ||
+                                      memcmp(pool->slots[slot].name->text, text, length) != 0)) {
+        slot = (slot + 1) & pool->mask;
+    }
+    return &pool->slots[slot];
+}
+
+/*
+ * Function to intern the length bytes at text, returning the one pool_name of that
+ * name. The table doubles when half full. Exits on allocation failure.
+ */
+const struct pool_name *intern_name(struct string_pool *pool, const char *text, size_t length) {
+    uint64_t hash = hash_key(text, length);
+    if (pool->slots) {
+        struct pool_slot *slot = string_pool_slot(pool, text, length, hash);
+        if (slot->hash) {
+            return slot->name;
+        }
+    }
+
+    if (2 * (pool->count + 1) > pool->mask + 1 || !pool->slots) {
+        size_t size = pool->slots ? 2 * (pool->mask + 1) : 1024;
+        struct pool_slot *slots = calloc(size, sizeof(struct pool_slot));
+        if (!slots) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        struct pool_slot *old_slots = pool->slots;
+        size_t old_size = old_slots ? pool->mask + 1 : 0;
+        pool->slots = slots;
+        pool->mask = size - 1;
+        for (size_t i = 0; i < old_size; i++) {
+            if (old_slots[i].hash) {
+                *string_pool_slot(pool, old_slots[i].name->text, old_slots[i].name->length, old_slots[i].hash) =
+                    old_slots[i];
+            }
+        }
+        free(old_slots);
+    }
+
+    struct pool_name *name = arena_alloc(pool->arena, sizeof(struct pool_name));
+    name->text = arena_strndup(pool->arena, text, length);
+    name->length = length;
+    name->id = pool->count++;
+    name->next = NULL;
+    if (pool->last) {
+        pool->last->next = name;
+    } else {
+        pool->first = name;
+    }
+    pool->last = name;
+
+    struct pool_slot *slot = string_pool_slot(pool, text, length, hash);
+    slot->hash = hash;
+    slot->name = name;
+    return name;
+}
+
+/* Function to free the table of a string pool, the names stay in its arena */
+void free_string_pool(struct string_pool *pool) {
+    free(pool->slots);
+    pool->slots = NULL;
+}
+
+/*
+ * Function to parse the contents of a soc_mod file and create a linked list of module information.
+ * The text is tokenized in a single pass: the indentation of each line tells a module
+ * name (0), a port name (4) and a port direction (6) apart. Lines may be of any length.
+ * When names is given, only the modules named in it are kept: the block of any other
+ * module is skipped a line at a time with memchr, without allocating.
+ * The nodes are allocated from the arena of pool, where their names are interned,
+ * and released with it.
+ * It returns the head of the module linked list.
+ */
+struct module_node *parse_soc_mod_buffer(const char *data, size_t size, const struct name_set *names,
+                                         struct string_pool *pool) {
+    struct module_node *modules_head = NULL;
+    struct module_node *current_module = NULL;
+    struct port_node *last_port = NULL;
+    const size_t module_indent_level = 0;
+    const size_t port_indent_level = 4;
+    const size_t direction_indent_level = 6;
+
+    const char *p = data;
+    const char *data_end = data + size;
+    while (p < data_end) {
+        const char *line = p;
+        const char *line_end = memchr(p, '\n', data_end - p);
+        if (!line_end) {
+            line_end = data_end;
+        }
+        p = line_end + 1;
+
+        /* Determine the indentation level */
+        const char *text = line;
+        while (text < line_end && isspace((unsigned char)*text)) text++;
+        size_t current_indent = text - line;
+
+        /* Skip empty lines and comments */
+        if (text == line_end || *text == '#') continue;
+
+        /* Check if the line represents a module name, the whole line up to the colon */
+        if (current_indent == module_indent_level) {
+            const char *name_end = memchr(text, ':', line_end - text);
+            if (!name_end) {
+                name_end = line_end;
+                while (name_end > text && isspace((unsigned char)name_end[-1])) name_end--;
+            }
+
+            if (names && !name_set_contains(names, text, name_end - text)) {
+                /* Skip the indented, empty and comment lines up to the next module */
+                while (p < data_end && (isspace((unsigned char)*p) || *p == '#')) {
+                    const char *next = memchr(p, '\n', data_end - p);
+                    p = next ? next + 1 : data_end;
+                }
+                last_port = NULL;
+                continue;
+            }
+
+            struct module_node *new_module = arena_alloc(pool->arena, sizeof(struct module_node));
+            new_module->module_name = intern_name(pool, text, name_end - text);
+            new_module->ports = NULL;
+            new_module->next = NULL;
+
+            if (current_module) {
+                current_module->next = new_module;
+            } else {
+                modules_head = new_module;
+            }
+            current_module = new_module;
+            last_port = NULL;
+        }
+        /* Check if the line represents a port name, the first word up to the colon */
+        else if (current_indent == port_indent_level) {
+            if (!current_module) continue;
+
+            struct port_node *new_port = arena_alloc(pool->arena, sizeof(struct port_node));
+            new_port->port_name = intern_name(pool, text, soc_mod_name_end(text, line_end) - text);
+            new_port->direction = 'B'; /* Default direction to 'B' */
+            new_port->next = NULL;
+
+            if (last_port) {
+                last_port->next = new_port;
+            } else {
+                current_module->ports = new_port;
+            }
+            last_port = new_port;
+        }
+        /* Check if the line represents a port direction */
+        else if (current_indent == direction_indent_level && last_port) {
+            const char *direction = memmem(text, line_end - text, "direction:", strlen("direction:"));
+            if (!direction) continue;
+            direction += strlen("direction:");
+            while (direction < line_end && isspace((unsigned char)*direction)) direction++;
+            size_t length = line_end - direction;
+
+            /* Set the direction of the last port node */
+            if (length >= strlen("inout") && memcmp(direction, "inout", strlen("inout")) == 0) {
+                last_port->direction = 'B';
+            } else if (length >= strlen("in") && memcmp(direction, "in", strlen("in")) == 0) {
+                last_port->direction = 'I';
+            } else if (length >= strlen("out") && memcmp(direction, "out", strlen("out")) == 0) {
+                last_port->direction = 'O';
+            }
+        }
+    }
+
+    return modules_head;
+}
+
+/* A *.PININFO line being laid out, wrapped with *+ lines past PININFO_WRAP_COLUMN */
+struct pininfo_layout {
+    char *out;               /* Text written so far, NULL to only measure it */
+    size_t length;           /* Length of the text */
+    size_t column;           /* Length of its last line */
+};
+
+/* Function to start a *.PININFO line, written to out unless out is NULL */
+void pininfo_layout_begin(struct pininfo_layout *layout, char *out) {
+    layout->out = out;
+    layout->length = strlen("*.PININFO");
+    layout->column = layout->length;
+    if (out) {
+        memcpy(out, "*.PININFO", layout->length);
+    }
+}
+
+/* Function to append " name:direction", on a new *+ line if it would pass the wrap column */
+void pininfo_layout_port(struct pininfo_layout *layout, const char *name, size_t name_length, char direction) {
+    if (layout->column > strlen("*+") && layout->column + name_length + 3 > PININFO_WRAP_COLUMN) {
+        if (layout->out) {
+            memcpy(layout->out + layout->length, "\n*+", 3);
+        }
+        layout->length += 3;
+        layout->column = 2;
+    }
+    if (layout->out) {
+        char *out = layout->out + layout->length;
+        out[0] = ' ';
+        memcpy(out + 1, name, name_length);
+        out[1 + name_length] = ':';
+        out[2 + name_length] = direction;
+    }
+    layout->length += name_length + 3;
+    layout->column += name_length + 3;
+}
+
+/*
+ * Function to lay out the *.PININFO line of a module, its ports in soc_mod order.
+ * The text is written to out unless out is NULL. Returns the length of the text.
+ */
+size_t layout_pininfo_line(const struct module_node *module, char *out) {
+    struct pininfo_layout layout;
+    pininfo_layout_begin(&layout, out);
+    for (struct port_node *current_port = module->ports; current_port; current_port = current_port->next) {
+        pininfo_layout_port(&layout, current_port->port_name->text, current_port->port_name->length,
+                            current_port->direction);
+    }
+    return layout.length;
+}
+
+/* Function to point the tables of index into image */
+void attach_module_image(struct module_index *index, void *image, size_t image_size, bool mapped) {
+    const struct module_image_header *header = image;
+    const char *p = (const char *)image + sizeof(struct module_image_header);
+    index->slots = (const struct module_slot *)p;
+    index->mask = header->slot_count - 1;
+    p += header->slot_count * sizeof(struct module_slot);
+    index->modules = (const struct module_record *)p;
+    p += header->module_count * sizeof(struct module_record);
+    index->ports = (const struct port_record *)p;
+    p += header->port_count * sizeof(struct port_record);
+    index->strings = p;
+    index->module_count = header->module_count;
+    index->port_count = header->port_count;
+    index->string_size = header->string_size;
+    index->image = image;
+    index->image_size = image_size;
+    index->mapped = mapped;
+}
+
+/*
+ * Function to compile the modules of a list parsed from source into the image of index.
+ * The names of the modules and ports are interned in pool, so each distinct name is
+ * stored once in the strings, and two modules have the same name exactly when their
+ * names have the same offset. When names repeat, the first module of the list is the
+ * one found and the others are reported. Each module with ports gets its *.PININFO
+ * line built here, once, for every .SUBCKT of it.
+ * The source fields of stamp are copied into the header.
+ * Returns 0 on success, -1 on allocation failure.
+ */
+int compile_module_index(struct module_node *modules, const struct string_pool *pool,
+                         const struct module_image_header *stamp, const char *source, struct module_index *index) {
+    /* Lay out the distinct names first, then the PININFO lines */
+    size_t *name_offsets = malloc((pool->count + 1) * sizeof(size_t));
+    if (!name_offsets) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return -1;
+    }
+    size_t string_size = 0;
+    for (const struct pool_name *name = pool->first; name; name = name->next) {
+        name_offsets[name->id] = string_size;
+        string_size += name->length + 1;
+    }
+
+    /* Size the tables and the strings */
+    size_t module_count = 0, port_count = 0;
+    for (struct module_node *current_module = modules; current_module; current_module = current_module->next) {
+        module_count++;
+        if (current_module->ports) {
+            string_size += layout_pininfo_line(current_module, NULL) + 1;
+        }
+        for (struct port_node *current_port = current_module->ports; current_port; current_port = current_port->next) {
+            port_count++;
+        }
+    }
+    string_size = (string_size + 7) & ~(size_t)7;
+    size_t slot_count = 16;
+    while (slot_count < 2 * module_count) {
+        slot_count *= 2;
+    }
+    size_t image_size = sizeof(struct module_image_header) + slot_count * sizeof(struct module_slot) +
+                        module_count * sizeof(struct module_record) + port_count * sizeof(struct port_record) +
+                        string_size;
+    char *image = calloc(1, image_size);
+    if (!image) {
+        free(name_offsets);
+        fprintf(stderr, "Memory allocation failed\n");
+        return -1;
+    }
+
+    struct module_image_header *header = (struct module_image_header *)image;
+    *header = *stamp;
+    memcpy(header->magic, MODULE_IMAGE_MAGIC, sizeof(header->magic));
+    header->version = MODULE_IMAGE_VERSION;
+    header->byte_order = 0x01020304;
+    header->slot_count = slot_count;
+    header->module_count = module_count;
+    header->port_count = port_count;
+    header->string_size = string_size;
+    attach_module_image(index, image, image_size, false);
+
+    /* Fill the strings and the records */
+    struct module_slot *slots = (struct module_slot *)index->slots;
+    struct module_record *module = (struct module_record *)index->modules;
+    struct port_record *port = (struct port_record *)index->ports;
+    char *strings = (char *)index->strings;
+    size_t string_used = 0, port_index = 0;
+    for (const struct pool_name *name = pool->first; name; name = name->next) {
+        memcpy(strings + string_used, name->text, name->length + 1);
+        string_used += name->length + 1;
+    }
+    for (struct module_node *current_module = modules; current_module; current_module = current_module->next) {
+        module->name = name_offsets[current_module->module_name->id];
+        module->name_length = current_module->module_name->length;
+
+        module->pininfo = string_used;
+        module->pininfo_length = 0;
+        if (current_module->ports) {
+            module->pininfo_length = layout_pininfo_line(current_module, strings + string_used);
+            string_used += module->pininfo_length + 1;
+        }
+
+        module->first_port = port_index;
+        module->port_count = 0;
+        for (struct port_node *current_port = current_module->ports; current_port; current_port = current_port->next) {
+            port->name = name_offsets[current_port->port_name->id];
+            port->name_length = current_port->port_name->length;
+            port->direction = current_port->direction;
+            port++;
+            port_index++;
+            module->port_count++;
+        }
+
+        /* Index the module by name, unless an earlier module has the same name */
+        uint64_t hash = hash_key(current_module->module_name->text, module->name_length);
+        size_t slot = hash & index->mask;
+        while (slots[slot].hash && index->modules[slots[slot].module].name != module->name) {
+            slot = (slot + 1) & index->mask;
+        }
+        if (!slots[slot].hash) {
+            slots[slot].hash = hash;
+            slots[slot].module = module - index->modules;
+        } else {
+            fprintf(stderr, "Duplicate module %s in %s, the first definition is used\n",
+                    current_module->module_name->text, source);
+        }
+        module++;
+    }
+    free(name_offsets);
+    return 0;
+}
+
+/* Function to release the image of a module index */
+void free_module_index(struct module_index *index) {
+    if (index->mapped) {
+        munmap(index->image, index->image_size);
+    } else {
+        free(index->image);
+    }
+    index->image = NULL;
+}
+
+/* Function to tell whether the length bytes at offset, then a null byte, lie within the strings */
+static inline bool image_string_fits(const struct module_index *index, uint64_t offset, uint64_t length) {
+    return offset < index->string_size && length < index->string_size - offset &&
+           index->strings[offset + length] == '\0';
+}
+
+/*
+ * Function to tell whether the ports and the PININFO line of a module record lie
+ * within the image. A mapped image is only checked as a whole by map_module_image,
+ * so its records are checked when they are used.
+ */
+static inline bool module_record_fits(const struct module_index *index, const struct module_record *module) {
+    return (uint64_t)module->first_port + module->port_count <= index->port_count &&
+           (!module->port_count || image_string_fits(index, module->pininfo, module->pininfo_length));
+}
+
+/*
+ * Function to check every module and port record of an image, for the readers
+ * that go through all of them, in one pass.
+ * Returns 0 if the records are sound, otherwise -1.
+ */
+int check_module_records(const struct module_index *index) {
+    for (size_t i = 0; i < index->module_count; i++) {
+        const struct module_record *module = &index->modules[i];
+        if (!image_string_fits(index, module->name, module->name_length) || !module_record_fits(index, module)) {
+            return -1;
+        }
+    }
+    for (size_t i = 0; i < index->port_count; i++) {
+        if (!image_string_fits(index, index->ports[i].name, index->ports[i].name_length)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Function to map the module index image at path.
+ * Only the header is checked, against the file size, so that mapping takes the
+ * same time whatever the size of the image; the records are checked where they
+ * are read, see find_module and subckt_pininfo.
+ * Returns 0 if the file holds an image this build can use, otherwise -1.
+ */
+int map_module_image(const char *path, struct module_index *index) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct module_image_header)) {
+        close(fd);
+        return -1;
+    }
+    void *image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        return -1;
+    }
+
+    /* The sizes in the header must add up to the file size */
+    const struct module_image_header *header = image;
+    size_t size = st.st_size;
+    if (memcmp(header->magic, MODULE_IMAGE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != MODULE_IMAGE_VERSION || header->byte_order != 0x01020304 ||
+        !header->slot_count || (header->slot_count & (header->slot_count - 1)) ||
+        header->slot_count > size / sizeof(struct module_slot) ||
+        header->module_count > size / sizeof(struct module_record) ||
+        header->port_count > size / sizeof(struct port_record) || header->string_size > size ||
+        sizeof(struct module_image_header) + header->slot_count * sizeof(struct module_slot) +
+        header->module_count * sizeof(struct module_record) + header->port_count * sizeof(struct port_record) +
+        header->string_size != size) {
+        munmap(image, size);
+        return -1;
+    }
+    attach_module_image(index, image, size, true);
+    return 0;
+}
+
+/*
+ * Function to write the image of index to path, through a temporary file renamed
+ * over it so that concurrent runs never see a partial image.
+ * Returns 0 on success, -1 on failure.
+ */
+int save_module_image(const char *path, const struct module_index *index) {
+    char *temp_path = malloc(strlen(path) + sizeof(".XXXXXX"));
+    if (!temp_path) {
+        return -1;
+    }
+    sprintf(temp_path, "%s.XXXXXX", path);
+    int fd = mkstemp(temp_path);
+    if (fd < 0) {
+        free(temp_path);
+        return -1;
+    }
+    struct iovec iov = { .iov_base = index->image, .iov_len = index->image_size };
+    int ret = (fchmod(fd, 0644) == 0 && writev_all(fd, &iov, 1) == 0) ? 0 : -1;
+    if (close(fd) != 0 || (ret == 0 && rename(temp_path, path) != 0)) {
+        ret = -1;
+    }
+    if (ret != 0) {
+        unlink(temp_path);
+    }
+    free(temp_path);
+    return ret;
+}
+
+/*
+ * Function to load the modules of a soc_mod file into index.
+ * With use_sidecar, the compiled image in filename.idx is mapped when it was built
+ * from a file of the same size and modification time, or of the same contents if
+ * only the time moved. Otherwise the file is parsed and the sidecar rewritten.
+ * With check_records, for an index that is read whole, a sidecar is only used when
+ * check_module_records passes, and rewritten otherwise.
+ * Without use_sidecar, names may restrict the index to the modules named in it.
+ * A file that cannot be read gives an index without modules.
+ * Returns 0 on success, -1 on allocation failure.
+ */
+int load_module_index(const char *filename, bool use_sidecar, bool check_records, const struct name_set *names,
+                      struct module_index *index) {
+    struct module_image_header stamp;
+    memset(&stamp, 0, sizeof(stamp));
+    index->image = NULL;
+    char *sidecar = NULL;
+    if (use_sidecar) {
+        sidecar = malloc(strlen(filename) + sizeof(MODULE_IMAGE_SUFFIX));
+        if (!sidecar) {
+            fprintf(stderr, "Memory allocation failed\n");
+            return -1;
+        }
+        sprintf(sidecar, "%s%s", filename, MODULE_IMAGE_SUFFIX);
+
+        /* A fresh sidecar is used without opening the soc_mod file at all */
+        struct stat st;
+        if (stat(filename, &st) == 0 && map_module_image(sidecar, index) == 0) {
+            const struct module_image_header *header = index->image;
+            if (check_records && check_module_records(index) != 0) {
+                free_module_index(index); /* A corrupt sidecar */
+            } else if (header->source_size == (uint64_t)st.st_size && header->source_mtime_sec == st.st_mtim.tv_sec &&
+                       header->source_mtime_nsec == st.st_mtim.tv_nsec) {
+                free(sidecar);
+                return 0;
+            }
+        }
+    }
+
+    struct input_buffer input = { .data = NULL, .size = 0, .mapped = false };
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open file: %s\n", filename);
+    } else {
+        struct stat st;
+        if (fstat(fd, &st) != 0 ||
+            (map_input(fd, &input) != 0 && read_input(fd, &input) != 0)) {
+            fprintf(stderr, "Failed to read file: %s\n", filename);
+            input.data = NULL;
+            input.size = 0;
+            input.mapped = false;
+        } else if (use_sidecar) {
+            stamp.source_size = input.size;
+            stamp.source_mtime_sec = st.st_mtim.tv_sec;
+            stamp.source_mtime_nsec = st.st_mtim.tv_nsec;
+            stamp.source_hash = hash_key(input.data, input.size);
+
+            /* Only the time moved: keep the image, and its new time so the contents are not hashed again */
+            const struct module_image_header *header = index->image;
+            if (header && header->source_size == stamp.source_size && header->source_hash == stamp.source_hash) {
+                int64_t mtime[2] = { stamp.source_mtime_sec, stamp.source_mtime_nsec };
+                int sidecar_fd = open(sidecar, O_WRONLY);
+                if (sidecar_fd >= 0) {
+                    if (pwrite(sidecar_fd, mtime, sizeof(mtime),
+                               offsetof(struct module_image_header, source_mtime_sec)) < 0) {
+                        fprintf(stderr, "Failed to update module index: %s\n", sidecar);
+                    }
+                    close(sidecar_fd);
+                }
+                release_input(&input);
+                close(fd);
+                free(sidecar);
+                return 0;
+            }
+        }
+        close(fd);
+    }
+    if (index->image) {
+        free_module_index(index); /* A stale sidecar */
+    }
+
+    /* Parse the text and compile it */
+    struct arena arena = { .head = NULL };
+    struct string_pool pool = { .slots = NULL, .mask = 0, .count = 0, .first = NULL, .last = NULL, .arena = &arena };
+    struct module_node *modules = parse_soc_mod_buffer(input.data, input.size, use_sidecar ? NULL : names, &pool);
+    int ret = compile_module_index(modules, &pool, &stamp, filename, index);
+    free_string_pool(&pool);
+    arena_release(&arena);
+    if (ret == 0 && use_sidecar && fd >= 0 && input.data && save_module_image(sidecar, index) != 0) {
+        fprintf(stderr, "Failed to write module index: %s\n", sidecar);
+    }
+    release_input(&input);
+    free(sidecar);
+    return ret;
+}
+
+/*
+ * Function to merge the indexes of count soc_mod files into index, releasing them.
+ * A module defined in more than one file is reported, the definition of the
+ * earliest file is used.
+ * Returns 0 on success, -1 on allocation failure.
+ */
+int merge_module_indexes(struct module_index *parts, const char *const *paths, size_t count,
+                         struct module_index *index) {
+    if (count == 1) {
+        *index = parts[0];
+        return 0;
+    }
+
+    /* Size the merged tables */
+    size_t module_count = 0, port_count = 0, string_size = 0;
+    for (size_t i = 0; i < count; i++) {
+        const struct module_image_header *header = parts[i].image;
+        module_count += header->module_count;
+        port_count += header->port_count;
+        string_size += header->string_size;
+    }
+    size_t slot_count = 16;
+    while (slot_count < 2 * module_count) {
+        slot_count *= 2;
+    }
+    size_t image_size = sizeof(struct module_image_header) + slot_count * sizeof(struct module_slot) +
+                        module_count * sizeof(struct module_record) + port_count * sizeof(struct port_record) +
+                        string_size;
+    char *image = calloc(1, image_size);
+    if (!image) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return -1;
+    }
+    struct module_image_header *header = (struct module_image_header *)image;
+    memcpy(header->magic, MODULE_IMAGE_MAGIC, sizeof(header->magic));
+    header->version = MODULE_IMAGE_VERSION;
+    header->byte_order = 0x01020304;
+    header->slot_count = slot_count;
+    header->module_count = module_count;
+    header->port_count = port_count;
+    header->string_size = string_size;
+    attach_module_image(index, image, image_size, false);
+
+    /* Append the records and strings of each file, shifting their offsets */
+    struct module_slot *slots = (struct module_slot *)index->slots;
+    struct module_record *module = (struct module_record *)index->modules;
+    struct port_record *port = (struct port_record *)index->ports;
+    char *strings = (char *)index->strings;
+    size_t string_base = 0, port_base = 0;
+    for (size_t i = 0; i < count; i++) {
+        const struct module_image_header *part_header = parts[i].image;
+        memcpy(strings + string_base, parts[i].strings, part_header->string_size);
+        for (size_t k = 0; k < part_header->port_count; k++) {
+            *port = parts[i].ports[k];
+            port->name += string_base;
+            port++;
+        }
+
+        size_t part_first = module - index->modules;
+        for (size_t k = 0; k < part_header->module_count; k++) {
+            *module = parts[i].modules[k];
+            module->name += string_base;
+            module->pininfo += string_base;
+            module->first_port += port_base;
+
+            /* Index the module by name, unless an earlier module has the same name */
+            const char *name = strings + module->name;
+            uint64_t hash = hash_key(name, module->name_length);
+            size_t slot = hash & index->mask;
+            while (slots[slot].hash) {
+                const struct module_record *other = &index->modules[slots[slot].module];
+                if (slots[slot].hash == hash && other->name_length == module->name_length &&
+                    memcmp(strings + other->name, name, module->name_length) == 0) {
+                    break;
+                }
+                slot = (slot + 1) & index->mask;
+            }
+            if (!slots[slot].hash) {
+                slots[slot].hash = hash;
+                slots[slot].module = module - index->modules;
+            } else if (slots[slot].module < part_first) {
+                /* Repeats within one file were reported when it was compiled */
+                const char *first_path = paths[0];
+                size_t first_module = 0;
+                for (size_t j = 0; j < i; j++) {
+                    first_module += ((const struct module_image_header *)parts[j].image)->module_count;
+                    if (slots[slot].module < first_module) {
+                        first_path = paths[j];
+                        break;
+                    }
+                }
+                fprintf(stderr, "Duplicate module %s in %s, already defined in %s\n", name, paths[i], first_path);
+            }
+            module++;
+        }
+        string_base += part_header->string_size;
+        port_base += part_header->port_count;
+    }
+    for (size_t i = 0; i < count; i++) {
+        free_module_index(&parts[i]);
+    }
+    return 0;
+}
+
+/* Shared state of the threads loading soc_mod files, each thread taking the next file */
+struct module_loader {
+    const char *const *paths;   /* Files to load */
+    struct module_index *parts; /* Index of each file */
+    size_t count;               /* Number of files */
+    bool use_sidecar;           /* Whether to use the compiled sidecars */
+    const struct name_set *names; /* Modules to keep, or NULL for all */
+    atomic_size_t next;         /* Index of the next file to hand out */
+    atomic_bool failed;         /* Whether any file failed to load */
+};
+
+/* Function run by each loader thread */
+void *module_loader_main(void *arg) {
+    struct module_loader *loader = arg;
+    while (1) {
+        size_t i = atomic_fetch_add(&loader->next, 1);
+        if (i >= loader->count) {
+            break;
+        }
+        if (load_module_index(loader->paths[i], loader->use_sidecar, loader->count > 1, loader->names,
+                              &loader->parts[i]) != 0) {
+            atomic_store(&loader->failed, true);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Function to load count soc_mod files into one module index, each file parsed
+ * (or mapped from its sidecar) on its own thread, up to one thread per CPU,
+ * then merged in the order given. See load_module_index for use_sidecar and names.
+ * Returns 0 on success, -1 on failure.
+ */
+int load_module_indexes(const char *const *paths, size_t count, bool use_sidecar, const struct name_set *names,
+                        struct module_index *index) {
+    if (!count) {
+        struct module_image_header stamp;
+        memset(&stamp, 0, sizeof(stamp));
+        struct string_pool pool = { .slots = NULL, .mask = 0, .count = 0, .first = NULL, .last = NULL, .arena = NULL };
+        return compile_module_index(NULL, &pool, &stamp, NULL, index);
+    }
+
+    struct module_index *parts = calloc(count, sizeof(struct module_index));
+    if (!parts) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return -1;
+    }
+    struct module_loader loader = {
+        .paths = paths,
+        .parts = parts,
+        .count = count,
+        .use_sidecar = use_sidecar,
+        .names = names,
+    };
+    atomic_init(&loader.next, 0);
+    atomic_init(&loader.failed, false);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t thread_count = cpus > 1 ? (size_t)cpus : 1;
+    if (thread_count > count) {
+        thread_count = count;
+    }
+    pthread_t *threads = thread_count > 1 ? malloc((thread_count - 1) * sizeof(pthread_t)) : NULL;
+    size_t started = 0;
+    if (threads) {
+        while (started < thread_count - 1 && pthread_create(&threads[started], NULL, module_loader_main, &loader) == 0) {
+            started++;
+        }
+    }
+    /* This thread loads files too, so the loading goes on if no thread could be started */
+    module_loader_main(&loader);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    int ret = -1;
+    if (!atomic_load(&loader.failed)) {
+        ret = merge_module_indexes(parts, paths, count, index);
+    }
+    if (ret != 0) {
+        for (size_t i = 0; i < count; i++) {
+            if (parts[i].image) {
+                free_module_index(&parts[i]);
+            }
+        }
+    }
+    free(parts);
+    return ret;
+}
+
+/* Paths given with --soc-module, in order */
+struct soc_module_list {
+    const char **paths;      /* The paths */
+    size_t count;            /* Number of paths */
+    size_t capacity;         /* Number of paths allocated */
+};
+
+/* Function to append a copy of path to the list */
+void add_soc_module_path(struct soc_module_list *list, const char *path) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 8;
+        list->paths = realloc(list->paths, list->capacity * sizeof(const char *));
+        if (!list->paths) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+    }
+    list->paths[list->count] = strdup(path);
+    if (!list->paths[list->count]) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    list->count++;
+}
+
+/* Function to free the paths of the list */
+void free_soc_module_list(struct soc_module_list *list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free((char *)list->paths[i]);
+    }
+    free(list->paths);
+    list->paths = NULL;
+    list->count = 0;
+    list->capacity = 0;
+}
+
+/* Callback of --soc-module, collecting every occurrence of the option */
+int soc_module_option(struct argparse *self, const struct argparse_option *option) {
+    (void)self;
+    add_soc_module_path((struct soc_module_list *)option->data, *(const char **)option->value);
+    return 0;
+}
+
+/* Function to compare two paths for qsort */
+int compare_paths(const void *a, const void *b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+/*
+ * Function to expand the directories of a path list into the *.soc_mod files they
+ * hold, in name order. Other paths are kept as given.
+ */
+void expand_soc_module_list(const struct soc_module_list *list, struct soc_module_list *files) {
+    for (size_t i = 0; i < list->count; i++) {
+        struct stat st;
+        DIR *dir = stat(list->paths[i], &st) == 0 && S_ISDIR(st.st_mode) ? opendir(list->paths[i]) : NULL;
+        if (!dir) {
+            add_soc_module_path(files, list->paths[i]);
+            continue;
+        }
+
+        size_t first = files->count;
+        struct dirent *entry;
+        while ((entry = readdir(dir))) {
+            size_t length = strlen(entry->d_name);
+            size_t suffix_length = strlen(".soc_mod");
+            if (length <= suffix_length || strcmp(entry->d_name + length - suffix_length, ".soc_mod") != 0) {
+                continue;
+            }
+            char *path = malloc(strlen(list->paths[i]) + length + 2);
+            if (!path) {
+                fprintf(stderr, "Memory allocation failed\n");
+                exit(1);
+            }
+            sprintf(path, "%s/%s", list->paths[i], entry->d_name);
+            if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+                add_soc_module_path(files, path);
+            }
+            free(path);
         }
+        closedir(dir);
+        qsort(files->paths + first, files->count - first, sizeof(const char *), compare_paths);
     }
-
-    return value; /* Return the value as is if no unit is found */
 }
 
-/* Converts a double to an SI unit string */
-void double_to_si(double value, char *si_str, size_t max_len) {
-    const struct { char *unit; double divisor; } units[] = {
-        {"Y", 1e24}, {"Z", 1e21}, {"E", 1e18}, {"P", 1e15}, {"T", 1e12},
-        {"G", 1e9}, {"M", 1e6}, {"k", 1e3}, {"h", 1e2}, {"da", 1e1},
-        {"d", 1e-1}, {"c", 1e-2}, {"m", 1e-3}, {"u", 1e-6}, {"n", 1e-9},
-        {"p", 1e-12}, {"f", 1e-15}, {"a", 1e-18}, {"z", 1e-21}, {"y", 1e-24}
-    };
-
-    size_t num_units = sizeof(units) / sizeof(units[0]);
-    for (size_t i = 0; i < num_units; i++) {
-        /* Check if the value fits into one of the SI unit ranges */
-        if (fabs(value) >= units[i].divisor && units[i].divisor != 1) {
-            snprintf(si_str, max_len, "%g%s", value / units[i].divisor, units[i].unit);
-            return;
+/*
+ * Function to look up the module named by the length bytes at name, NULL if unknown.
+ * The probe stops after every slot was seen, and slots or names that lie outside
+ * a corrupt image are passed over.
+ */
+const struct module_record *find_module(const struct module_index *index, const char *name, size_t length) {
+    uint64_t hash = hash_key(name, length);
+    size_t slot = hash & index->mask;
+    for (size_t probes = 0; probes <= index->mask && index->slots[slot].hash; probes++) {
+        if (index->slots[slot].hash == hash && index->slots[slot].module < index->module_count) {
+            const struct module_record *module = &index->modules[index->slots[slot].module];
+            if (module->name_length == length && image_string_fits(index, module->name, length) &&
+                memcmp(index->strings + module->name, name, length) == 0) {
+                return module;
+            }
         }
+        slot = (slot + 1) & index->mask;
     }
+    return NULL;
+}
 
-    /* Fallback to simple decimal representation if no unit fits */
-    snprintf(si_str, max_len, "%g", value);
+/* Function to get the *.PININFO line of a module with ports */
+static inline const char *module_pininfo(const struct module_index *index, const struct module_record *module) {
+    return index->strings + module->pininfo;
 }
 
-/* Function to free the memory allocated for the linked list */
-void free_lines(struct line_node *head) {
-    while (head) {
-        struct line_node *temp = head;
-        head = head->next;
-        free(temp->line);  /* Free the string */
-        free(temp);        /* Free the node */
+/*
+ * Function to extract the module name of a .SUBCKT line, the keyword in any case.
+ * Returns true with the first word after .SUBCKT in *name and *length, false if
+ * the line is no .SUBCKT line.
+ */
+bool subckt_module_name(const struct line_entry *entry, const char **name, size_t *length) {
+    const char *p = entry->line;
+    const char *line_end = entry->line + entry->length;
+    while (p < line_end && is_token_space(*p)) p++;
+    if (line_end - p < 7 || strncasecmp(p, ".SUBCKT", 7) != 0) {
+        return false;
     }
+
+    p += strlen(".SUBCKT");
+    while (p < line_end && isspace((unsigned char)*p)) p++;
+    const char *module_name = p;
+    while (p < line_end && !isspace((unsigned char)*p)) p++;
+    *name = module_name;
+    *length = p - module_name;
+    return p != module_name;
 }
 
-/* Function to split buffer into a linked list of strings */
-struct line_node *split_buffer(const char *buffer, size_t *line_count) {
-    *line_count = 0;  /* Initialize line count */
-    if (!buffer || !*buffer) {
-        return NULL;  /* Return NULL for empty buffer */
+/**
+ * Function to find the module matching a .SUBCKT line.
+ * It extracts the module name following .SUBCKT and returns the module only if
+ * it is known and has ports, otherwise NULL.
+ */
+const struct module_record *find_subckt_module(const struct line_entry *entry, const struct module_index *modules) {
+    const char *module_name;
+    size_t length;
+    if (!subckt_module_name(entry, &module_name, &length)) {
+        return NULL;
     }
 
-    struct line_node *head = NULL, *current = NULL;
-
-    /* Iterate over the buffer to split it into lines */
-    const char *start = buffer;
-    while (1) {
-        const char *end = strchr(start, '\n');  /* Find the end of the current line */
-        size_t len = (end ? end - start : strlen(start));  /* Compute line length */
-
-        if (len > 0) {  /* Check if line has content */
-            /* Allocate memory for the new node */
-            struct line_node *new_node = malloc(sizeof(struct line_node));
-            if (!new_node) {
-                free_lines(head);  /* Free previously allocated nodes */
-                fprintf(stderr, "Memory allocation failed\n");
-                return NULL;
-            }
+    /* Find corresponding module information */
+    const struct module_record *module = find_module(modules, module_name, length);
+    /* Only modules with ports produce a PININFO line */
+    return module && module->port_count ? module : NULL;
+}
 
-            /* Allocate memory for the line */
-            new_node->line = malloc(len + 1);
-            if (!new_node->line) {
-                free(new_node);
-                free_lines(head);
-                fprintf(stderr, "Memory allocation failed\n");
-                return NULL;
-            }
+/* A PININFO line belonging after the .SUBCKT line at index */
+struct pininfo_insert {
+    size_t index;            /* Index of the last line of the .SUBCKT statement, relative to the first line */
+    struct line_entry pininfo; /* The PININFO line */
+};
 
-            /* Copy the line into the new node */
-            strncpy(new_node->line, start, len);
-            new_node->line[len] = '\0';  /* Null-terminate the string */
-            new_node->next = NULL;
+/* Growable array of PININFO insertions */
+struct pininfo_inserts {
+    struct pininfo_insert *items; /* Insertions, by increasing index once sorted */
+    size_t count;            /* Number of insertions */
+    size_t capacity;         /* Number of insertions allocated */
+};
 
-            /* Link the new node into the list */
-            if (current) {
-                current->next = new_node;
-            } else {
-                head = new_node;
-            }
-            current = new_node;
-            (*line_count)++;  /* Increment line count */
+/* Function to record that a PININFO line belongs after the line at index */
+void add_pininfo_insert(struct pininfo_inserts *inserts, size_t index, const struct line_entry *pininfo) {
+    if (inserts->count == inserts->capacity) {
+        inserts->capacity = inserts->capacity ? inserts->capacity * 2 : 64;
+        inserts->items = realloc(inserts->items, inserts->capacity * sizeof(struct pininfo_insert));
+        if (!inserts->items) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
         }
-        if (!end) break;  /* Exit loop if no more lines */
-        start = end + 1;  /* Move to the start of the next line */
     }
-    return head;
+    inserts->items[inserts->count].index = index;
+    inserts->items[inserts->count].pininfo = *pininfo;
+    inserts->count++;
 }
 
-/* Function to join a linked list of strings into a single buffer with newline separators */
-char *join_lines(struct line_node *head, size_t *buffer_size) {
-    *buffer_size = 0;
-    if (!head) {
-        return NULL;  /* Return NULL for empty list */
+/* Function to move every insertion of src to the end of dst */
+void merge_pininfo_inserts(struct pininfo_inserts *dst, struct pininfo_inserts *src) {
+    for (size_t i = 0; i < src->count; i++) {
+        add_pininfo_insert(dst, src->items[i].index, &src->items[i].pininfo);
     }
+    free(src->items);
+    src->items = NULL;
+    src->count = src->capacity = 0;
+}
+
+/* Function to order PININFO insertions by line index, for qsort */
+int compare_pininfo_inserts(const void *a, const void *b) {
+    const struct pininfo_insert *x = a, *y = b;
+    return (x->index > y->index) - (x->index < y->index);
+}
 
-    /* Calculate the total length of the joined string */
-    size_t total_length = 0;
-    for (struct line_node *current = head; current; current = current->next) {
-        total_length += strlen(current->line) + 1;  /* Include space for newline */
+/* Function to tell whether a line is an existing *.PININFO line */
+static inline bool is_pininfo_line(const struct line_entry *entry) {
+    return line_starts_with(entry, "*.PININFO");
+}
+
+/* Function to tell whether a line continues a *.PININFO line */
+static inline bool is_pininfo_continuation(const struct line_entry *entry) {
+    return line_starts_with(entry, "*+");
+}
+
+/**
+ * Function to insert or update *.PININFO line after .SUBCKT line in the line list.
+ * The .SUBCKT statements and their modules were found by fix_statement and are
+ * given in inserts, sorted by index. An existing PININFO line right after the
+ * statement is replaced, its *+ continuation lines are dropped in a forward pass.
+ * The other lines are inserted by growing the array once, then moving every line
+ * at most once in a backward pass to open the gaps. The inserted text must
+ * outlive the list.
+ */
+void insert_pininfo(struct line_list *list, struct pininfo_inserts *inserts) {
+    struct line_entry *lines = list->entries + list->first;
+    size_t insert_count = 0;
+
+    /* Drop the continuation lines of existing PININFO lines, shifting the indexes to match */
+    size_t removed = 0, kept = 0;
+    for (size_t k = 0; k < inserts->count; k++) {
+        size_t i = inserts->items[k].index;
+        inserts->items[k].index = i - removed;
+        if (i + 1 >= list->count || !is_pininfo_line(&lines[i + 1])) {
+            continue;
+        }
+        size_t end = i + 2;
+        while (end < list->count && is_pininfo_continuation(&lines[end])) {
+            end++;
+        }
+        if (end == i + 2) {
+            continue;
+        }
+        if (removed) {
+            memmove(&lines[kept - removed], &lines[kept], (i + 2 - kept) * sizeof(struct line_entry));
+        }
+        removed += end - (i + 2);
+        kept = end;
+    }
+    if (removed) {
+        memmove(&lines[kept - removed], &lines[kept], (list->count - kept) * sizeof(struct line_entry));
+        list->count -= removed;
     }
 
-    /* Allocate memory for the combined buffer */
-    char *buffer = malloc(total_length + 1);  /* Add space for null terminator */
-    if (!buffer) {
-        fprintf(stderr, "Memory allocation failed\n");
-        return NULL;
+    /* Replace existing PININFO lines, count the lines to insert */
+    for (size_t k = 0; k < inserts->count; k++) {
+        size_t i = inserts->items[k].index;
+        if (i + 1 < list->count && is_pininfo_line(&lines[i + 1])) {
+            lines[i + 1] = inserts->items[k].pininfo;
+        } else if (i + 1 < list->count) {
+            insert_count++;
+        }
+    }
+    if (!insert_count) {
+        return;
     }
 
-    /* Copy lines into the buffer and add newline characters */
-    char *ptr = buffer;
-    for (struct line_node *current = head; current; current = current->next) {
-        ptr = stpcpy(ptr, current->line);  /* Copy line to buffer */
-        *ptr++ = '\n';  /* Add newline character */
+    /* Grow the array once for all inserted lines */
+    size_t new_count = list->count + insert_count;
+    if (list->first + new_count > list->capacity) {
+        list->capacity = list->first + new_count;
+        list->entries = realloc(list->entries, list->capacity * sizeof(struct line_entry));
+        if (!list->entries) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        lines = list->entries + list->first;
     }
-    *ptr = '\0';  /* Null-terminate the buffer */
-    *buffer_size = total_length;  /* Update buffer size */
 
-    return buffer;
-}
+    /* Walk backwards, moving each run of lines to its final place */
+    size_t src_end = list->count, dst = new_count;
+    for (size_t k = inserts->count; k > 0; k--) {
+        const struct pininfo_insert *insert = &inserts->items[k - 1];
+        if (insert->index + 1 >= list->count || is_pininfo_line(&lines[insert->index + 1])) {
+            continue; /* Replaced above, or the .SUBCKT line is the last line */
+        }
 
-/* Function to insert a new line at the beginning of the list */
-void prepend_line(struct line_node **head, const char *new_line) {
-    struct line_node *new_node = (struct line_node *)malloc(sizeof(struct line_node));
-    if (!new_node) {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(1); /* Exit if memory allocation fails */
+        size_t run = src_end - (insert->index + 1);
+        dst -= run;
+        memmove(&lines[dst], &lines[insert->index + 1], run * sizeof(struct line_entry));
+        dst--;
+        lines[dst] = insert->pininfo;
+        src_end = insert->index + 1;
     }
-    new_node->line = strdup(new_line);  /* Duplicate the string */
-    new_node->next = *head;
-    *head = new_node;
+    list->count = new_count;
 }
 
-/* Function to check each line and prepend if pattern is not matched */
-void check_and_prepend(struct line_node **head, const char *pattern, const char *prepend_str) {
-    regex_t regex;
-    int prepend_needed = 1;
-    struct line_node *current = *head;
+/* Header prepended before the cdl parameter directives */
+static const char *const cdl_generated_header =
+    "************************************************************************\n"
+    "* Generated by by smic180bcd_cdl_fixer\n"
+    "* Author: Huang Rui <vowstar@gmail.com>\n"
+    "\n"
+    "* CDL parameter\n"
+    "************************************************************************\n";
+
+/* Header prepended before the netlist itself */
+static const char *const cdl_netlist_header =
+    "\n"
+    "************************************************************************\n"
+    "* CDL netlist\n"
+    "************************************************************************\n";
+
+/* A cdl parameter directive and the line prepended when the netlist lacks it */
+struct cdl_directive {
+    const char *keyword;     /* Prefix of the lines carrying the directive */
+    const char *prepend;     /* Line prepended when no line carries it */
+};
+
+/* Define cdl_directives, in reverse order of the prepended lines */
+static const struct cdl_directive cdl_directives[] = {
+    { ".PARAM", ".PARAM" },
+    { "*.MEGA", "*.MEGA" },
+    { "*.EQUATION", "*.EQUATION" },
+    { "*.DIOAREA", "*.DIOAREA" },
+    { "*.DIOPERI", "*.DIOPERI" },
+    { "*.CAPVAL", "*.CAPVAL" },
+    { "*.RESVAL", "*.RESVAL" },
+    { "*.BIPOLAR", "*.BIPOLA" },
+};
 
-    regcomp(&regex, pattern, REG_EXTENDED | REG_NOSUB | REG_NEWLINE);
+#define CDL_DIRECTIVE_COUNT (sizeof(cdl_directives) / sizeof(cdl_directives[0]))
+#define CDL_DIRECTIVES_ALL ((1u << CDL_DIRECTIVE_COUNT) - 1)
 
-    /* Check each line for the pattern */
-    while (current) {
-        if (regexec(&regex, current->line, 0, NULL, 0) == 0) { /* Match found */
-            prepend_needed = 0;
-            break;
+/*
+ * Function to find the directive a line starts with.
+ * The first bytes select the only candidates, so a line is compared against at
+ * most two keywords and most lines are rejected by their first byte.
+ * Returns the bit of the directive in cdl_directives, or 0 if there is none.
+ */
+unsigned match_directive(const char *line, size_t length) {
+    size_t first, last;
+
+    if (length >= 2 && line[0] == '.') {
+        first = last = 0;
+    } else if (length >= 3 && line[0] == '*' && line[1] == '.') {
+        switch (line[2]) {
+        case 'M': first = last = 1; break;
+        case 'E': first = last = 2; break;
+        case 'D': first = 3; last = 4; break;
+        case 'C': first = last = 5; break;
+        case 'R': first = last = 6; break;
+        case 'B': first = last = 7; break;
+        default: return 0;
         }
-        current = current->next;
+    } else {
+        return 0;
     }
 
-    /* Prepend if no lines match the pattern */
-    if (prepend_needed) {
-        prepend_line(head, prepend_str);
+    for (size_t i = first; i <= last; i++) {
+        size_t keyword_length = strlen(cdl_directives[i].keyword);
+        if (length >= keyword_length && memcmp(line, cdl_directives[i].keyword, keyword_length) == 0) {
+            return 1u << i;
+        }
     }
-
-    regfree(&regex);
+    return 0;
 }
 
-/* Helper function to replace all occurrences of a pattern in a string */
-char *str_replace(const char *str, const char *pattern, const char *replacement) {
-    size_t str_len = strlen(str);
-    size_t pattern_len = strlen(pattern);
-    size_t replacement_len = strlen(replacement);
+/* Define cdl_case_keys, the parameter keys written in lower case */
+static const char *const cdl_case_keys[] = {
+    "w", "l", "area", "pj", "m", "fw", "c", "r", "fingers",
+};
 
-    /* Count the number of occurrences of the pattern */
-    size_t count = 0;
-    const char *tmp = str;
-    while ((tmp = strstr(tmp, pattern))) {
-        count++;
-        tmp += pattern_len;
-    }
+#define CDL_CASE_KEY_COUNT (sizeof(cdl_case_keys) / sizeof(cdl_case_keys[0]))
+#define CDL_CASE_KEY_MAX_LENGTH (7)
 
-    /* Calculate new string length */
-    size_t new_len = str_len + count * (replacement_len - pattern_len);
+/*
+ * Function to write the parameter keys of a line in lower case, in place.
+ * A key is the run of letters before an '=' that follows a space. Every '=' is
+ * found with memchr and its key compared case-insensitively against cdl_case_keys.
+ * Lowering a key keeps the line length, so nothing is allocated or moved.
+ */
+void normalize_keys(char *line, size_t length) {
+    char *end = line + length;
+    char *equal = line;
+
+    while ((equal = memchr(equal, '=', end - equal))) {
+        /* Walk back over the ASCII letters of the key */
+        char *key = equal;
+        while (key > line && ((key[-1] | 0x20) >= 'a' && (key[-1] | 0x20) <= 'z')) {
+            key--;
+        }
+        size_t key_length = equal - key;
+        equal++;
+        if (key == line || key[-1] != ' ' || !key_length || key_length > CDL_CASE_KEY_MAX_LENGTH) {
+            continue;
+        }
 
-    /* Allocate memory for the new string */
-    char *result = malloc(new_len + 1);  /* +1 for the null terminator */
-    if (!result) {
-        return NULL;  /* Memory allocation failed */
+        char lowered[CDL_CASE_KEY_MAX_LENGTH];
+        for (size_t i = 0; i < key_length; i++) {
+            lowered[i] = key[i] | 0x20;
+        }
+        for (size_t i = 0; i < CDL_CASE_KEY_COUNT; i++) {
+            if (strlen(cdl_case_keys[i]) == key_length && memcmp(lowered, cdl_case_keys[i], key_length) == 0) {
+                memcpy(key, lowered, key_length);
+                break;
+            }
+        }
     }
+}
 
-    /* Replace each occurrence of the pattern */
-    const char *current = str;
-    char *new_str = result;
-    while ((tmp = strstr(current, pattern))) {
-        size_t len = tmp - current;
-        memcpy(new_str, current, len);  /* Copy characters before the pattern */
-        memcpy(new_str + len, replacement, replacement_len);  /* Copy replacement */
-        current = tmp + pattern_len;
-        new_str += len + replacement_len;
+/* Switches selecting the stages of fix_statement */
+struct fix_options {
+    int no_param;            /* Skip directive detection */
+    int no_case_conversion;  /* Skip case conversion */
+    int no_calc_data;        /* Skip data calculation */
+    int sig_digits;          /* Significant digits of calculated values, 0 for the shortest exact */
+    int stats;               /* Print the geometry cache statistics to stderr */
+};
+
+/* State of fix_statement for one thread: enabled stages and what was seen so far */
+struct fix_context {
+    const struct fix_options *options; /* Enabled stages */
+    const struct module_index *modules; /* Modules for PININFO lookup, or NULL */
+    unsigned directives;               /* Bit i set once directive i was seen */
+    struct geometry_cache cache;       /* Suffixes calculated so far */
+    struct line_entry *pins;           /* Pins of the last .SUBCKT statement */
+    size_t pin_capacity;               /* Number of pins allocated */
+};
+
+/* Function to prepare a context for fix_statement */
+void fix_context_init(struct fix_context *ctx, const struct fix_options *options,
+                      const struct module_index *modules) {
+    ctx->options = options;
+    ctx->modules = modules;
+    ctx->directives = 0;
+    ctx->cache.entries = NULL;
+    ctx->cache.stats.lookups = 0;
+    ctx->cache.stats.hits = 0;
+    ctx->pins = NULL;
+    ctx->pin_capacity = 0;
+    if (!options->no_calc_data) {
+        geometry_cache_init(&ctx->cache);
     }
-    strcpy(new_str, current);  /* Copy the rest of the string */
+}
 
-    return result;
+/* Function to free the geometry cache and the pin list of a fix_statement context */
+void fix_context_free(struct fix_context *ctx) {
+    geometry_cache_free(&ctx->cache);
+    free(ctx->pins);
+    ctx->pins = NULL;
 }
 
-/* Function to replace substrings in each line of the linked list */
-void replace_substrings(struct line_node *head, const char **patterns, size_t pattern_count) {
-    if (!head) {
-        return; /* No operation if list is empty */
+/*
+ * Function to collect the pins of a .SUBCKT statement into ctx->pins, as views.
+ * The pins are the words after the module name, on the first line and its '+'
+ * continuation lines, up to the first parameter, a word with '=' or ending in ':'
+ * such as PARAM:. Returns the number of pins.
+ */
+size_t collect_subckt_pins(struct fix_context *ctx, const struct line_entry *segments, size_t count) {
+    const char *module_name;
+    size_t module_length;
+    if (!subckt_module_name(&segments[0], &module_name, &module_length)) {
+        return 0;
     }
 
-    struct line_node *current = head;
-    while (current) {
-        for (size_t i = 0; i < pattern_count; i += 2) {
-            const char *pattern = patterns[i];
-            const char *replacement = patterns[i + 1];
+    size_t pin_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        const char *p = i ? segments[i].line + 1 : module_name + module_length; /* Skip the '+' */
+        const char *line_end = segments[i].line + segments[i].length;
+        while (1) {
+            while (p < line_end && isspace((unsigned char)*p)) p++;
+            if (p == line_end) {
+                break;
+            }
+            const char *pin = p;
+            while (p < line_end && !isspace((unsigned char)*p)) p++;
+            if (memchr(pin, '=', p - pin) || p[-1] == ':') {
+                return pin_count;
+            }
 
-            char *result = str_replace(current->line, pattern, replacement);
-            if (result) {
-                free(current->line);
-                current->line = result;
+            if (pin_count == ctx->pin_capacity) {
+                ctx->pin_capacity = ctx->pin_capacity ? ctx->pin_capacity * 2 : 64;
+                ctx->pins = realloc(ctx->pins, ctx->pin_capacity * sizeof(struct line_entry));
+                if (!ctx->pins) {
+                    fprintf(stderr, "Memory allocation failed\n");
+                    exit(1);
+                }
             }
+            ctx->pins[pin_count].line = pin;
+            ctx->pins[pin_count].length = p - pin;
+            pin_count++;
         }
-        current = current->next;
     }
+    return pin_count;
 }
 
-/* Function to process each line of the linked list */
-void process_list(struct line_node *head) {
-    if (!head) {
-        return; /* No operation if list is empty */
+/*
+ * Function to build the PININFO line of a .SUBCKT statement of module into *pininfo.
+ * The pins declared by the statement are checked against the ports of the module:
+ * when they are the same in the same order, the module's prebuilt line is used.
+ * Otherwise the ports are put in a hash set, each pin is looked up in it and the
+ * line is built in arena in pin-declaration order, O(pins + ports). Pins that are
+ * no port keep the default direction B, ports that are no pin are left out, and
+ * both are reported on stderr.
+ * Returns 0 on success, or -1 without a line if the record of the module lies
+ * outside a corrupt image.
+ */
+int subckt_pininfo(struct fix_context *ctx, const struct line_entry *segments, size_t count,
+                   const struct module_record *module, struct arena *arena, struct line_entry *pininfo) {
+    const struct module_index *modules = ctx->modules;
+    bool sound = module_record_fits(modules, module);
+    for (size_t k = 0; sound && k < module->port_count; k++) {
+        const struct port_record *port = &modules->ports[module->first_port + k];
+        sound = image_string_fits(modules, port->name, port->name_length);
+    }
+    if (!sound) {
+        fprintf(stderr, "Module index entry of %s is corrupt, delete the .idx file to rebuild it\n",
+                modules->strings + module->name);
+        return -1;
+    }
+    const struct port_record *ports = &modules->ports[module->first_port];
+    size_t pin_count = collect_subckt_pins(ctx, segments, count);
+
+    /* The usual case: the pins are the ports, in order */
+    bool same_order = pin_count == module->port_count;
+    for (size_t i = 0; same_order && i < pin_count; i++) {
+        same_order = ctx->pins[i].length == ports[i].name_length &&
+                     memcmp(ctx->pins[i].line, modules->strings + ports[i].name, ports[i].name_length) == 0;
+    }
+    if (same_order) {
+        pininfo->line = module_pininfo(modules, module);
+        pininfo->length = module->pininfo_length;
+        return 0;
     }
-    /* Compile regular expressions for matching */
-    regex_t regex_w, regex_l, regex_fingers, regex_area, regex_pj;
-    regcomp(&regex_w, "w=([0-9]+\\.?[0-9]*[a-zA-Z]+)", REG_EXTENDED);
-    regcomp(&regex_l, "l=([0-9]+\\.?[0-9]*[a-zA-Z]+)", REG_EXTENDED);
-    regcomp(&regex_fingers, "fingers=([0-9]+\\.?[0-9]*[a-zA-Z]*)", REG_EXTENDED);
-    regcomp(&regex_area, "area=([0-9]+\\.?[0-9]*[a-zA-Z]+)", REG_EXTENDED);
-    regcomp(&regex_pj, "pj=([0-9]+\\.?[0-9]*[a-zA-Z]+)", REG_EXTENDED);
-
-    struct line_node *current = head;
-
-    while (current) {
-        /* Initialize variables for processing */
-        double w = 0.0, l = 0.0, fw, fingers = 1.0;
-        double area = 0.0, pj = 0.0;
-        char fw_str[MAX_NAME_LENGTH], l_str[MAX_NAME_LENGTH], w_str[MAX_NAME_LENGTH];
-        bool w_found = false, l_found = false, fingers_found = false;
-        bool area_found = false, pj_found = false;
 
-        regmatch_t matches[2];
+    /* Index the ports by name, the value of a slot is the port index plus one */
+    struct name_set port_set = { .slots = NULL, .mask = 0, .count = 0 };
+    for (size_t k = 0; k < module->port_count; k++) {
+        struct name_slot *slot = name_set_add(&port_set, modules->strings + ports[k].name, ports[k].name_length);
+        if (!slot->value) {
+            slot->value = k + 1;
+        }
+    }
+    bool *declared = calloc(module->port_count, sizeof(bool));
+    if (!declared) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
 
-        /* Check for 'w' value and convert to double */
-        if (regexec(&regex_w, current->line, 2, matches, 0) == 0) {
-            w = si_to_double(current->line + matches[1].rm_so);
-            w_found = true;
+    /* Measure the line, then write it, looking each pin up once */
+    struct pininfo_layout layout;
+    pininfo_layout_begin(&layout, NULL);
+    for (size_t i = 0; i < pin_count; i++) {
+        pininfo_layout_port(&layout, ctx->pins[i].line, ctx->pins[i].length, 'B');
+    }
+    char *text = arena_alloc(arena, layout.length + 1);
+    pininfo_layout_begin(&layout, text);
+    for (size_t i = 0; i < pin_count; i++) {
+        const struct name_slot *slot = name_set_find(&port_set, ctx->pins[i].line, ctx->pins[i].length);
+        char direction = 'B';
+        if (slot) {
+            declared[slot->value - 1] = true;
+            direction = ports[slot->value - 1].direction;
+        } else {
+            fprintf(stderr, "Pin %.*s of .SUBCKT %s is not a port of the module\n",
+                    (int)ctx->pins[i].length, ctx->pins[i].line, modules->strings + module->name);
         }
-        /* Check for 'l' value and convert to double */
-        if (regexec(&regex_l, current->line, 2, matches, 0) == 0) {
-            l = si_to_double(current->line + matches[1].rm_so);
-            l_found = true;
+        pininfo_layout_port(&layout, ctx->pins[i].line, ctx->pins[i].length, direction);
+    }
+    text[layout.length] = '\0';
+    for (size_t k = 0; k < module->port_count; k++) {
+        if (!declared[k] && name_set_find(&port_set, modules->strings + ports[k].name, ports[k].name_length)->value == k + 1) {
+            fprintf(stderr, "Port %s of module %s is missing from its .SUBCKT pins\n",
+                    modules->strings + ports[k].name, modules->strings + module->name);
         }
+    }
+    free(declared);
+    free_name_set(&port_set);
 
-        /* Check for 'fingers' value and convert to double */
-        if (regexec(&regex_fingers, current->line, 2, matches, 0) == 0) {
-            fingers = si_to_double(current->line + matches[1].rm_so);
-            fingers_found = true;
+    pininfo->line = text;
+    pininfo->length = layout.length;
+    return 0;
+}
+
+/* Kinds of statements, told apart by the first non-blank character of their first line */
+enum line_class {
+    LINE_OTHER,              /* Element lines that carry no geometry, e.g. L, V, I */
+    LINE_DEVICE,             /* Elements that can carry geometry: M, R, C, D, Q, X */
+    LINE_DOT,                /* Dot commands, e.g. .SUBCKT, .ENDS, .PARAM */
+    LINE_COMMENT,            /* Comments, including the *.DIRECTIVE lines */
+    LINE_CONTINUATION,       /* A '+' line with no statement before it */
+    LINE_BLANK,              /* Nothing but blanks */
+};
+
+/* Define line_classes, the class of a line by its first non-blank character */
+static const unsigned char line_classes[256] = {
+    ['M'] = LINE_DEVICE, ['m'] = LINE_DEVICE,
+    ['R'] = LINE_DEVICE, ['r'] = LINE_DEVICE,
+    ['C'] = LINE_DEVICE, ['c'] = LINE_DEVICE,
+    ['D'] = LINE_DEVICE, ['d'] = LINE_DEVICE,
+    ['Q'] = LINE_DEVICE, ['q'] = LINE_DEVICE,
+    ['X'] = LINE_DEVICE, ['x'] = LINE_DEVICE,
+    ['.'] = LINE_DOT,
+    ['*'] = LINE_COMMENT,
+    ['+'] = LINE_CONTINUATION,
+};
+
+/* Function to classify a line by its first non-blank character */
+enum line_class classify_line(const struct line_entry *entry) {
+    const char *p = entry->line;
+    const char *end = entry->line + entry->length;
+    while (p < end && is_token_space(*p)) {
+        p++;
+    }
+    return p < end ? (enum line_class)line_classes[(unsigned char)*p] : LINE_BLANK;
+}
+
+/* Function to collect the module names of the .SUBCKT lines of the list into names */
+void collect_subckt_names(const struct line_list *list, struct name_set *names) {
+    const struct line_entry *lines = list->entries + list->first;
+    for (size_t i = 0; i < list->count; i++) {
+        const char *name;
+        size_t length;
+        if (classify_line(&lines[i]) == LINE_DOT && subckt_module_name(&lines[i], &name, &length)) {
+            name_set_add(names, name, length);
         }
+    }
+}
 
-        /* Calculate fw and append it to the line */
-        if (w_found && l_found) {
-            fw = fingers_found ? (w / fingers) : w;
-            double_to_si(fw, fw_str, sizeof(fw_str));
-            char *new_line = (char *)malloc((strlen(current->line) + sizeof(fw_str) + 10) * sizeof(char));
-            if (!new_line) {
-                fprintf(stderr, "Memory allocation failed\n");
-                exit(1);
+/* Function to write the parameter keys of every line of a statement in lower case */
+static inline void normalize_statement_keys(struct line_entry *segments, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        /* Lines reaching fix_statement are writable, see map_input */
+        normalize_keys((char *)segments[i].line, segments[i].length);
+    }
+}
+
+/*
+ * Function to fix one statement of count lines, running the enabled stages that
+ * apply to its class while the lines are hot. Element lines get case conversion
+ * and, for devices, data calculation over the whole statement. Dot commands get
+ * case conversion, are checked for directives and looked up for PININFO, comments
+ * are checked for directives.
+ * Returns true with the PININFO line in *pininfo when one belongs after the statement.
+ */
+bool fix_statement(struct fix_context *ctx, struct line_entry *segments, size_t count, struct arena *arena,
+                   struct line_entry *pininfo) {
+    enum line_class line_class = classify_line(&segments[0]);
+
+    switch (line_class) {
+    case LINE_DEVICE:
+    case LINE_OTHER:
+        if (!ctx->options->no_case_conversion) {
+            normalize_statement_keys(segments, count);
+        }
+        if (line_class == LINE_DEVICE && !ctx->options->no_calc_data) {
+            process_statement(segments, count, ctx->options->sig_digits, &ctx->cache, arena);
+        }
+        return false;
+    case LINE_DOT:
+        if (!ctx->options->no_param) {
+            ctx->directives |= match_directive(segments[0].line, segments[0].length);
+        }
+        if (!ctx->options->no_case_conversion) {
+            normalize_statement_keys(segments, count);
+        }
+        if (ctx->modules) {
+            const struct module_record *module = find_subckt_module(&segments[0], ctx->modules);
+            if (module) {
+                return subckt_pininfo(ctx, segments, count, module, arena, pininfo) == 0;
             }
-            sprintf(new_line, "%s fw=%s", current->line, fw_str);
-            free(current->line);
-            current->line = new_line;
         }
-
-        /* Check for 'area' value and convert to double */
-        if (regexec(&regex_area, current->line, 2, matches, 0) == 0) {
-            area = si_to_double(current->line + matches[1].rm_so);
-            area_found = true;
+        return false;
+    case LINE_COMMENT:
+        if (!ctx->options->no_param) {
+            ctx->directives |= match_directive(segments[0].line, segments[0].length);
         }
+        return false;
+    default:
+        return false;
+    }
+}
 
-        /* Check for 'pj' value and convert to double */
-        if (regexec(&regex_pj, current->line, 2, matches, 0) == 0) {
-            pj = si_to_double(current->line + matches[1].rm_so);
-            pj_found = true;
-        }
+/* Shared state of the fix threads */
+struct fix_pool {
+    struct line_entry *lines;   /* Lines to fix */
+    size_t count;               /* Number of lines */
+    size_t *chunk_starts;       /* First line of each chunk, then count */
+    size_t chunk_count;         /* Number of chunks */
+    atomic_size_t next_chunk;   /* Index of the next chunk to hand out */
+    const struct fix_options *options; /* Enabled stages */
+    const struct module_index *modules; /* Modules for PININFO lookup, or NULL */
+};
 
-        if (area_found && pj_found) {
-            double delta = pj * pj - 4 * area;
-            if (delta < 0) {
-                /* If delta is negative, continue to next line */
-                current = current->next;
-                continue;
-            }
-            double delta_sqrt = sqrt(pj * pj / 4 - 4 * area);
-            double l1 = (pj / 2 + delta_sqrt) / 2;
-            double l2 = (pj / 2 - delta_sqrt) / 2;
-            double w1, w2;
+/* A fix thread, with its own context, arena and insertions so that workers share nothing */
+struct fix_worker {
+    pthread_t thread;           /* Thread running fix_worker_main */
+    struct fix_pool *pool;      /* Shared state */
+    struct arena arena;         /* Storage of the lines rewritten by this worker */
+    struct pininfo_inserts inserts; /* PININFO lines found by this worker */
+    unsigned directives;        /* Directives seen by this worker */
+    struct geometry_stats stats;/* Geometry cache use of this worker */
+};
 
-            /* Check if both l1 and l2 are less than or equal to 0 */
-            if (l1 <= 0 && l2 <= 0) {
-                /* If both are <= 0, continue to next line */
-                current = current->next;
-                continue;
-            }
+/* Function run by each fix thread, taking chunks until none is left */
+void *fix_worker_main(void *arg) {
+    struct fix_worker *worker = arg;
+    struct fix_pool *pool = worker->pool;
+    struct fix_context ctx;
 
-            /* Calculate w1 and w2 */
-            w1 = area / l1;
-            w2 = area / l2;
+    fix_context_init(&ctx, pool->options, pool->modules);
+    while (1) {
+        size_t chunk = atomic_fetch_add(&pool->next_chunk, 1);
+        if (chunk >= pool->chunk_count) {
+            break;
+        }
+        size_t end = pool->chunk_starts[chunk + 1];
 
-            /* Compare l1 and w1 */
-            if (l1 >= w1) {
-                /* If l1 is less than or equal to w1, select l1 and w1 */
-                double_to_si(l1, l_str, sizeof(l_str));
-                double_to_si(w1, w_str, sizeof(w_str));
-            } else {
-                /* Otherwise, select l2 and w2 */
-                double_to_si(l2, l_str, sizeof(l_str));
-                double_to_si(w2, w_str, sizeof(w_str));
+        /* Chunks start on statements, so no statement is shared between threads */
+        for (size_t i = pool->chunk_starts[chunk]; i < end;) {
+            size_t next = i + 1;
+            while (next < end && is_continuation(&pool->lines[next])) {
+                next++;
             }
-
-            /* Append l and w to the line */
-            char *new_line = (char *)malloc((strlen(current->line) + strlen(w_str) + strlen(l_str) + 10) * sizeof(char));
-            if (!new_line) {
-                fprintf(stderr, "Memory allocation failed\n");
-                exit(1);
+            struct line_entry pininfo;
+            if (fix_statement(&ctx, &pool->lines[i], next - i, &worker->arena, &pininfo)) {
+                add_pininfo_insert(&worker->inserts, next - 1, &pininfo);
             }
-            sprintf(new_line, "%s w=%s l=%s", current->line, w_str, l_str);
-            free(current->line);
-            current->line = new_line;
+            i = next;
         }
-
-        /* Move to the next line in the list */
-        current = current->next;
     }
-
-    /* Free the regex structures */
-    regfree(&regex_w);
-    regfree(&regex_l);
-    regfree(&regex_fingers);
-    regfree(&regex_area);
-    regfree(&regex_pj);
+    worker->directives = ctx.directives;
+    worker->stats = ctx.cache.stats;
+    fix_context_free(&ctx);
+    return NULL;
 }
 
-/**
- * Function to free a linked list of port nodes.
- * This function will iterate through the list of port_node and free each node.
- * @param ports Pointer to the head of the port_node list.
+/*
+ * Function to fix every line of the list in a single pass, on thread_count threads.
+ * The list is cut into chunks of about FIX_CHUNK_LINES lines that the threads take
+ * in turn, each chunk starting on a statement. Every line is rewritten in its own slot, so the list keeps its order and
+ * the output does not depend on the thread count. The arenas of the threads are
+ * handed over to the list, their PININFO insertions are merged into inserts by
+ * line index, the directives they saw are returned in *directives and their
+ * geometry cache use is summed into *stats.
+ * Returns 0 on success, -1 if no thread could be started.
  */
-void free_ports(struct port_node *ports) {
-    struct port_node *current_port = ports;
-    while (current_port) {
-        struct port_node *next_port = current_port->next;
-        free(current_port->port_name);  // Free the dynamically allocated port name
-        free(current_port);             // Free the port node itself
-        current_port = next_port;       // Move to the next port node
+int fix_lines(struct line_list *list, const struct fix_options *options, const struct module_index *modules,
+              int thread_count, unsigned *directives, struct pininfo_inserts *inserts,
+              struct geometry_stats *stats) {
+    struct fix_pool pool = {
+        .lines = list->entries + list->first,
+        .count = list->count,
+        .options = options,
+        .modules = modules,
+    };
+    atomic_init(&pool.next_chunk, 0);
+
+    if (thread_count < 1) {
+        thread_count = 1;
     }
+    struct fix_worker *workers = calloc(thread_count, sizeof(struct fix_worker));
+    pool.chunk_count = (pool.count + FIX_CHUNK_LINES - 1) / FIX_CHUNK_LINES;
+    pool.chunk_starts = malloc((pool.chunk_count + 1) * sizeof(size_t));
+    if (!workers || !pool.chunk_starts) {
+        free(workers);
+        free(pool.chunk_starts);
+        fprintf(stderr, "Memory allocation failed\n");
+        return -1;
+    }
+
+    /* Move every chunk start past the continuation lines of the statement before it */
+    pool.chunk_starts[0] = 0;
+    for (size_t chunk = 1; chunk < pool.chunk_count; chunk++) {
+        size_t start = chunk * FIX_CHUNK_LINES;
+        if (start < pool.chunk_starts[chunk - 1]) {
+            start = pool.chunk_starts[chunk - 1];
+        }
+        while (start < pool.count && is_continuation(&pool.lines[start])) {
+            start++;
+        }
+        pool.chunk_starts[chunk] = start;
+    }
+    pool.chunk_starts[pool.chunk_count] = pool.count;
+
+    int started = 0;
+    if (thread_count == 1) {
+        /* Run in the calling thread */
+        workers[0].pool = &pool;
+        fix_worker_main(&workers[0]);
+        started = 1;
+    } else {
+        for (int i = 0; i < thread_count; i++) {
+            workers[i].pool = &pool;
+            if (pthread_create(&workers[i].thread, NULL, fix_worker_main, &workers[i]) != 0) {
+                break;
+            }
+            started++;
+        }
+        if (!started) {
+            free(workers);
+            free(pool.chunk_starts);
+            fprintf(stderr, "Failed to start worker threads\n");
+            return -1;
+        }
+        for (int i = 0; i < started; i++) {
+            pthread_join(workers[i].thread, NULL);
+        }
+    }
+
+    *directives = 0;
+    for (int i = 0; i < started; i++) {
+        arena_merge(&list->arena, &workers[i].arena);
+        merge_pininfo_inserts(inserts, &workers[i].inserts);
+        *directives |= workers[i].directives;
+        stats->lookups += workers[i].stats.lookups;
+        stats->hits += workers[i].stats.hits;
+    }
+    if (started > 1) {
+        qsort(inserts->items, inserts->count, sizeof(struct pininfo_insert), compare_pininfo_inserts);
+    }
+    free(workers);
+    free(pool.chunk_starts);
+    return 0;
 }
 
 /*
- * Function to parse the input.soc_mod file and create a linked list of module information.
- * This function dynamically allocates memory for module_node and port_node structures.
- * It returns the head of the module linked list.
+ * Function to scan the input for the cdl parameter directives before streaming.
+ * The directives seen are returned as a bitmask in *directives. When spool is
+ * given, the whole input is copied into it so that a pipe can be read a second
+ * time, otherwise the scan stops as soon as every directive is found.
+ * Returns 0 on success, -1 on a read or write error.
  */
-struct module_node* parse_soc_mod_file(const char *filename) {
-    FILE *file = fopen(filename, "r");
-    if (!file) {
-        fprintf(stderr, "Failed to open file: %s\n", filename);
-        return NULL;
+int scan_directives(FILE *file_in, FILE *spool, unsigned *directives) {
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    int ret = 0;
+
+    *directives = 0;
+    while ((*directives != CDL_DIRECTIVES_ALL || spool) && (length = getline(&line, &capacity, file_in)) != -1) {
+        if (spool && fwrite(line, 1, length, spool) != (size_t)length) {
+            ret = -1;
+            break;
+        }
+        *directives |= match_directive(line, length);
+    }
+    if (ferror(file_in)) {
+        ret = -1;
     }
 
-    char line[MAX_LINE_LENGTH];
-    struct module_node *modules_head = NULL;
-    struct module_node *current_module = NULL;
-    struct module_node *new_module = NULL;
-    struct port_node *last_port = NULL;
-    const int module_indent_level = 0;
-    const int port_indent_level = 4;
-    const int direction_indent_level = 6;
-
-    while (fgets(line, sizeof(line), file)) {
-        /* Remove newline character */
-        line[strcspn(line, "\n")] = 0;
-
-        /* Determine the indentation level */
-        int current_indent = 0;
-        while (isspace((unsigned char)line[current_indent])) current_indent++;
+    free(line);
+    return ret;
+}
 
-        /* Skip empty lines and comments */
-        if (line[current_indent] == '\0' || (line[current_indent] == '#')) continue;
+/* Output side of stream_lines, carried from one statement to the next */
+struct stream_state {
+    FILE *file_out;          /* Output file */
+    char *pininfo;           /* PININFO line of the last .SUBCKT statement, kept past its arena */
+    size_t pininfo_length;   /* Length of pininfo */
+    size_t pininfo_capacity; /* Number of bytes allocated for pininfo */
+    bool pininfo_pending;    /* Whether pininfo still has to be written */
+    bool pininfo_replaced;   /* Whether an existing PININFO line was just replaced, its *+ lines go too */
+};
 
-        /* Check if the line represents a module name */
-        if (current_indent == module_indent_level) {
-            new_module = malloc(sizeof(struct module_node));
-            new_module->module_name = strdup(line + current_indent);
-            char *colon_pos = strchr(new_module->module_name, ':');
-            if (colon_pos) *colon_pos = '\0'; /* Remove the colon */
+/* Function to fix one statement of stream_lines and write it out */
+void stream_statement(struct fix_context *ctx, struct line_entry *segments, size_t count,
+                      struct arena *arena, struct stream_state *state) {
+    /* Continuation lines of a replaced PININFO line are dropped with it */
+    if (state->pininfo_replaced && is_pininfo_continuation(&segments[0])) {
+        return;
+    }
+    state->pininfo_replaced = false;
+
+    struct line_entry pininfo;
+    bool has_pininfo = fix_statement(ctx, segments, count, arena, &pininfo);
+
+    /* The PININFO line of the previous .SUBCKT goes before this statement, or replaces its first line */
+    size_t first = 0;
+    if (state->pininfo_pending) {
+        fwrite(state->pininfo, 1, state->pininfo_length, state->file_out);
+        fputc('\n', state->file_out);
+        state->pininfo_pending = false;
+        if (is_pininfo_line(&segments[0])) {
+            state->pininfo_replaced = true;
+            first = 1;
+        }
+    }
+    if (has_pininfo) {
+        if (pininfo.length > state->pininfo_capacity) {
+            state->pininfo_capacity = pininfo.length;
+            free(state->pininfo);
+            state->pininfo = malloc(state->pininfo_capacity);
+            if (!state->pininfo) {
+                fprintf(stderr, "Memory allocation failed\n");
+                exit(1);
+            }
+        }
+        memcpy(state->pininfo, pininfo.line, pininfo.length);
+        state->pininfo_length = pininfo.length;
+        state->pininfo_pending = true;
+    }
 
-            new_module->ports = NULL;
-            new_module->next = NULL;
+    for (size_t i = first; i < count; i++) {
+        fwrite(segments[i].line, 1, segments[i].length, state->file_out);
+        fputc('\n', state->file_out);
+    }
+}
 
-            if (current_module) {
-                current_module->next = new_module;
-            } else {
-                modules_head = new_module;
+/*
+ * Function to fix the netlist line by line with bounded memory.
+ * Every statement is read, fixed and written before the next one is read, so the
+ * memory used is bounded by the longest statement rather than by the netlist size.
+ * The directives are found by a pre-scan of the input: a seekable input is read
+ * twice, anything else is spooled into a temporary file during the pre-scan.
+ * Returns 0 on success, 1 on failure.
+ */
+int stream_lines(FILE *file_in, FILE *file_out, const struct fix_options *options,
+                 const struct module_index *modules) {
+    unsigned directives = 0;
+    FILE *spool = NULL;
+
+    /* Large stdio buffers keep the number of read and write calls low */
+    setvbuf(file_in, NULL, _IOFBF, STREAM_BUFFER_SIZE);
+    setvbuf(file_out, NULL, _IOFBF, STREAM_BUFFER_SIZE);
+
+    if (!options->no_param) {
+        /* Probe whether the input can be rewound after the pre-scan */
+        off_t start = ftello(file_in);
+        bool seekable = start != -1 && fseeko(file_in, start, SEEK_SET) == 0;
+        if (!seekable) {
+            spool = tmpfile();
+            if (!spool) {
+                fprintf(stderr, "Failed to create temporary file\n");
+                return 1;
             }
-            current_module = new_module;
-            last_port = NULL;
         }
-        /* Check if the line represents a port name */
-        else if (current_indent == port_indent_level) {
-            char port_name[MAX_NAME_LENGTH];
-            char format_string[20];
-            snprintf(format_string, sizeof(format_string), "%%%ds", MAX_NAME_LENGTH - 1);
-            sscanf(line + current_indent, format_string, port_name);
-            char *colon_pos = strchr(port_name, ':');
-            if (colon_pos) *colon_pos = '\0'; /* Remove the colon */
-
-            struct port_node *new_port = malloc(sizeof(struct port_node));
-            new_port->port_name = strdup(port_name);
-            new_port->direction = 'B'; /* Default direction to 'B' */
-            new_port->next = NULL;
 
-            if (last_port) {
-                last_port->next = new_port;
-            } else if (current_module) {
-                current_module->ports = new_port;
+        if (scan_directives(file_in, spool, &directives) != 0) {
+            fprintf(stderr, "Failed to read input\n");
+            if (spool) {
+                fclose(spool);
             }
-            last_port = new_port;
+            return 1;
         }
-        /* Check if the line represents a port direction */
-        else if (current_indent == direction_indent_level && strstr(line, "direction:")) {
-            char *direction = strstr(line, "direction:") + strlen("direction:");
-            while (isspace((unsigned char)*direction)) direction++;
 
-            /* Set the direction of the last port node */
-            if (last_port) {
-                if (strncmp(direction, "inout", strlen("inout")) == 0) {
-                    last_port->direction = 'B';
-                } else if (strncmp(direction, "in", strlen("in")) == 0) {
-                    last_port->direction = 'I';
-                } else if (strncmp(direction, "out", strlen("out")) == 0) {
-                    last_port->direction = 'O';
-                }
+        if (spool) {
+            rewind(spool);
+            file_in = spool;
+        } else {
+            fseeko(file_in, start, SEEK_SET);
+        }
+    }
+
+    /* Emit the headers and the missing directives in the order prepend_line produces */
+    fputs(cdl_generated_header, file_out);
+    fputc('\n', file_out);
+    if (!options->no_param) {
+        for (size_t i = CDL_DIRECTIVE_COUNT; i > 0; i--) {
+            if (!(directives & (1u << (i - 1)))) {
+                fputs(cdl_directives[i - 1].prepend, file_out);
+                fputc('\n', file_out);
             }
         }
     }
+    fputs(cdl_netlist_header, file_out);
+    fputc('\n', file_out);
+
+    /* Directives are known already, so the per-line stages skip their detection */
+    const struct fix_options line_options = {
+        .no_param = 1,
+        .no_case_conversion = options->no_case_conversion,
+        .no_calc_data = options->no_calc_data,
+        .sig_digits = options->sig_digits,
+        .stats = options->stats,
+    };
+    struct fix_context ctx;
+    fix_context_init(&ctx, &line_options, modules);
+
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    struct stream_state state = {
+        .file_out = file_out,
+        .pininfo = NULL,
+        .pininfo_length = 0,
+        .pininfo_capacity = 0,
+        .pininfo_pending = false,
+        .pininfo_replaced = false,
+    };
+    struct line_entry *segments = NULL;
+    size_t segment_count = 0, segment_capacity = 0;
+    struct arena arena = { .head = NULL };
 
-    fclose(file);
-    return modules_head;
-}
+    while ((length = getline(&line, &capacity, file_in)) != -1) {
+        if (length > 0 && line[length - 1] == '\n') {
+            line[--length] = '\0';
+        }
+        if (length == 0) {
+            continue; /* Empty lines are dropped, as split_buffer does */
+        }
 
-/**
- * Function to free a linked list of module nodes.
- * This function will iterate through the list of module_node and free each node,
- * along with its associated ports by calling free_ports.
- * @param modules Pointer to the head of the module_node list.
- */
-void free_modules(struct module_node *modules) {
-    struct module_node *current_module = modules;
-    while (current_module) {
-        struct module_node *next_module = current_module->next;
-        free(current_module->module_name);  // Free the dynamically allocated module name
-        free_ports(current_module->ports);   // Free the linked list of ports
-        free(current_module);               // Free the module node itself
-        current_module = next_module;       // Move to the next module node
-    }
-}
+        /* A line other than a continuation ends the statement held so far */
+        struct line_entry entry = { .line = line, .length = length };
+        if (!is_continuation(&entry) && segment_count) {
+            stream_statement(&ctx, segments, segment_count, &arena, &state);
+            segment_count = 0;
+            arena_reset(&arena);
+        }
 
-/**
- * Function to insert or update *.PININFO line after .SUBCKT line in the linked list.
- * It searches for .SUBCKT lines, extracts the module name, and then adds or updates
- * the *.PININFO line based on the module information in the module_node linked list.
- */
-void insert_pininfo(struct line_node *head, struct module_node *modules) {
-    while (head && head->next) {
-        if (strncmp(head->line, ".SUBCKT", strlen(".SUBCKT")) == 0) {
-            char module_name[MAX_NAME_LENGTH];  /* Assuming a max module name length of MAX_NAME_LENGTH */
-            char format_string[20];
-            snprintf(format_string, sizeof(format_string), "%%%ds", MAX_NAME_LENGTH - 1);
-            sscanf(head->line + strlen(".SUBCKT"), format_string, module_name);  /* Extract module name */
-
-            /* Find corresponding module information */
-            struct module_node *current_module = modules;
-            while (current_module) {
-                if (strcmp(current_module->module_name, module_name) == 0) {
-                    /* Check if the module has ports */
-                    if (current_module->ports) {
-                        /* Match found, build the *.PININFO line */
-                        char pininfo_line[MAX_LINE_LENGTH] = "*.PININFO";  /* Start building PININFO line */
-                        struct port_node *current_port = current_module->ports;
-                        while (current_port) {
-                            char port_info[MAX_NAME_LENGTH];
-                            sprintf(port_info, " %s:%c", current_port->port_name, current_port->direction);
-                            strcat(pininfo_line, port_info);
-                            current_port = current_port->next;
-                        }
-
-                        /* Check if next line is already a PININFO line */
-                        if (head->next && strncmp(head->next->line, "*.PININFO", strlen("*.PININFO")) == 0) {
-                            free(head->next->line);  /* Free the existing line */
-                            head->next->line = strdup(pininfo_line);  /* Replace with new line */
-                        } else {
-                            /* Insert new PININFO line */
-                            struct line_node *new_node = malloc(sizeof(struct line_node));
-                            new_node->line = strdup(pininfo_line);
-                            new_node->next = head->next;
-                            head->next = new_node;
-                        }
-                    }
-                    break;  /* Exit loop after processing */
-                }
-                current_module = current_module->next;
+        /* The statement is held in the arena until its last line is read */
+        if (segment_count == segment_capacity) {
+            segment_capacity = segment_capacity ? segment_capacity * 2 : 16;
+            segments = realloc(segments, segment_capacity * sizeof(struct line_entry));
+            if (!segments) {
+                fprintf(stderr, "Memory allocation failed\n");
+                exit(1);
             }
         }
-        head = head->next;
+        segments[segment_count].line = arena_strndup(&arena, line, length);
+        segments[segment_count].length = length;
+        segment_count++;
+    }
+    if (segment_count) {
+        stream_statement(&ctx, segments, segment_count, &arena, &state);
+    }
+    int ret = ferror(file_in) ? 1 : 0;
+    if (ret) {
+        fprintf(stderr, "Failed to read input\n");
     }
+    /* Write errors stick to the stream, so checking once after the flush catches them all */
+    if (fflush(file_out) != 0 || ferror(file_out)) {
+        fprintf(stderr, "Failed to write output\n");
+        ret = 1;
+    }
+    if (options->stats) {
+        print_geometry_stats(&ctx.cache.stats);
+    }
+    fix_context_free(&ctx);
+
+    free(line);
+    free(segments);
+    free(state.pininfo);
+    arena_release(&arena);
+    if (spool) {
+        fclose(spool);
+    }
+    return ret;
 }
 
+/* The programs under tests/ include this file with CDL_FIXER_NO_MAIN defined and bring their own main */
+#ifndef CDL_FIXER_NO_MAIN
 int main(int argc, const char *argv[]) {
-    char *buffer;
-    long length;
     FILE *file_in = stdin;
     FILE *file_out = stdout;
 
     /* Defile argparse variables */
-    int no_param = 0;
-    int no_case_conversion = 0;
-    int no_calc_data = 0;
+    struct fix_options fix = { .no_param = 0, .no_case_conversion = 0, .no_calc_data = 0, .sig_digits = 0, .stats = 0 };
+    int stream = 0;
+    int soc_index = 0;
+    int threads = 1;
     const char *soc_module = NULL;
+    struct soc_module_list soc_modules = { .paths = NULL, .count = 0, .capacity = 0 };
     const char *input = NULL;
     const char *output = NULL;
 
@@ -602,10 +3336,16 @@ int main(int argc, const char *argv[]) {
         OPT_STRING('i', "input", &input, "input file", NULL, 0, 0),
         OPT_STRING('o', "output", &output, "output file", NULL, 0, 0),
         OPT_GROUP("Additional options"),
-        OPT_BOOLEAN(0, "no-param", &no_param, "disable param", NULL, 0, 0),
-        OPT_BOOLEAN(0, "no-case-conversion", &no_case_conversion, "disable case conversion", NULL, 0, 0),
-        OPT_BOOLEAN(0, "no-calc-data", &no_calc_data, "disable data calculation", NULL, 0, 0),
-        OPT_STRING('m', "soc-module", &soc_module, "specify SOC module", NULL, 0, 0),
+        OPT_BOOLEAN(0, "no-param", &fix.no_param, "disable param", NULL, 0, 0),
+        OPT_BOOLEAN(0, "no-case-conversion", &fix.no_case_conversion, "disable case conversion", NULL, 0, 0),
+        OPT_BOOLEAN(0, "no-calc-data", &fix.no_calc_data, "disable data calculation", NULL, 0, 0),
+        OPT_INTEGER(0, "sig-digits", &fix.sig_digits, "round calculated data to N significant digits, 0 for exact", NULL, 0, 0),
+        OPT_STRING('m', "soc-module", &soc_module, "specify SOC module, repeatable, or a directory of *.soc_mod",
+                   soc_module_option, (intptr_t)&soc_modules, 0),
+        OPT_BOOLEAN(0, "soc-index", &soc_index, "keep a compiled index of each SOC module next to it", NULL, 0, 0),
+        OPT_BOOLEAN(0, "stream", &stream, "process line by line with bounded memory", NULL, 0, 0),
+        OPT_BOOLEAN(0, "stats", &fix.stats, "print geometry cache statistics to stderr", NULL, 0, 0),
+        OPT_INTEGER('j', "threads", &threads, "convert on N threads, 0 for all CPUs (not with --stream)", NULL, 0, 0),
         OPT_END(),
     };
 
@@ -613,6 +3353,8 @@ int main(int argc, const char *argv[]) {
         "smic180bcd_cdl_fixer < input.cdl > output.cdl",
         "smic180bcd_cdl_fixer --input input.cdl --output output.cdl",
         "smic180bcd_cdl_fixer --input input.cdl --output output.cdl --soc-module example.soc_mod",
+        "smic180bcd_cdl_fixer --stream < input.cdl > output.cdl",
+        "smic180bcd_cdl_fixer --threads 8 --input input.cdl --output output.cdl",
         NULL,
     };
 
@@ -621,6 +3363,11 @@ int main(int argc, const char *argv[]) {
     argparse_describe(&argparse, "Fix smic180bcd cdl netlist for ic618 spiceIn", NULL);
     argc = argparse_parse(&argparse, argc, argv);
 
+    if (fix.sig_digits < 0 || fix.sig_digits > MAX_SIGNIFICANT_DIGITS) {
+        fprintf(stderr, "Significant digits must be between 0 and %d\n", MAX_SIGNIFICANT_DIGITS);
+        return 1;
+    }
+
     /* Process input file path */
     if (input != NULL) {
         file_in = fopen(input, "r");
@@ -639,113 +3386,112 @@ int main(int argc, const char *argv[]) {
         }
     }
 
-    /* Seek to the end of the file to get length */
-    fseek(file_in, 0, SEEK_END);
-    length = ftell(file_in);
-    fseek(file_in, 0, SEEK_SET);
+    struct module_index module_index = { .image = NULL, .mapped = false };
+    const struct module_index *modules = NULL;
+    struct soc_module_list soc_files = { .paths = NULL, .count = 0, .capacity = 0 };
+    expand_soc_module_list(&soc_modules, &soc_files);
+    free_soc_module_list(&soc_modules);
+
+    if (stream) {
+        /* Load the SOC module files whole, their modules merged and indexed by name */
+        if (soc_files.count) {
+            int ret = load_module_indexes(soc_files.paths, soc_files.count, soc_index, NULL, &module_index);
+            free_soc_module_list(&soc_files);
+            if (ret != 0) {
+                return 1;
+            }
+            modules = &module_index;
+        }
+
+        int ret = stream_lines(file_in, file_out, &fix, modules);
+        free_module_index(&module_index);
+        if (file_in != stdin) {
+            fclose(file_in);
+        }
+        if (file_out != stdout && fclose(file_out) != 0 && ret == 0) {
+            fprintf(stderr, "Failed to write output\n");
+            ret = 1;
+        }
+        return ret;
+    }
 
-    /* Allocate memory for the buffer */
-    buffer = (char *)malloc(length);
-    if (!buffer) {
-        fprintf(stderr, "Failed to allocate memory\n");
+    /* Map a regular file, lines are views into the mapping until they are modified */
+    struct input_buffer input_buffer;
+    if (map_input(fileno(file_in), &input_buffer) != 0 &&
+        read_input(fileno(file_in), &input_buffer) != 0) {
+        /* Pipes, sockets and terminals are read in large chunks instead */
+        fprintf(stderr, "Failed to read input\n");
+        return 1;
+    }
+    /* Split the buffer into a list of lines */
+    struct line_list lines;
+    if (split_buffer(input_buffer.data, input_buffer.size, &lines) != 0) {
         return 1;
     }
-    memset(buffer, 0, length);
 
-    /* Read the file into the buffer */
-    fread(buffer, 1, length, file_in);
-    /* Split the buffer into a linked list of lines */
-    size_t line_count;
-    struct line_node *head = split_buffer(buffer, &line_count);
-    /* Free the buffer */
-    free(buffer);
+    /* Load the modules of the SOC module files that the netlist defines, merged and indexed by name */
+    if (soc_files.count) {
+        struct name_set names = { .slots = NULL, .mask = 0, .count = 0 };
+        if (!soc_index) {
+            collect_subckt_names(&lines, &names);
+        }
+        int ret = load_module_indexes(soc_files.paths, soc_files.count, soc_index, soc_index ? NULL : &names,
+                                      &module_index);
+        free_name_set(&names);
+        free_soc_module_list(&soc_files);
+        if (ret != 0) {
+            return 1;
+        }
+        modules = &module_index;
+    }
 
-    /* Prepend param information */
-    do {
-        const char *header =
-            "\n"
-            "************************************************************************\n"
-            "* CDL netlist\n"
-            "************************************************************************\n";
+    if (threads == 0) {
+        /* Use every online CPU */
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (int)cpus : 1;
+    }
 
-        prepend_line(&head, header);
+    /* Fix every line in a single pass */
+    unsigned directives;
+    struct pininfo_inserts inserts = { .items = NULL, .count = 0, .capacity = 0 };
+    struct geometry_stats stats = { .lookups = 0, .hits = 0 };
+    if (fix_lines(&lines, &fix, modules, threads, &directives, &inserts, &stats) != 0) {
+        return 1;
+    }
+    if (fix.stats) {
+        print_geometry_stats(&stats);
     }
-    while (0);
 
-    if (!no_param) {
-        /* Define cdl_parameter_patterns and corresponding strings to prepend, in reverse order */
-        const char *cdl_param_patterns[] = {
-            "^\\.PARAM.*\n", ".PARAM",
-            "^\\*\\.MEGA.*\n", "*.MEGA",
-            "^\\*\\.EQUATION.*\n", "*.EQUATION",
-            "^\\*\\.DIOAREA.*\n", "*.DIOAREA",
-            "^\\*\\.DIOPERI.*\n", "*.DIOPERI",
-            "^\\*\\.CAPVAL.*\n", "*.CAPVAL",
-            "^\\*\\.RESVAL.*\n", "*.RESVAL",
-            "^\\*\\.BIPOLAR.*\n", "*.BIPOLA",
-        };
+    /* Insert or update PININFO lines */
+    insert_pininfo(&lines, &inserts);
+    free(inserts.items);
+
+    /* Prepend param information */
+    prepend_line(&lines, cdl_netlist_header);
 
-        /* Check and prepend strings if necessary */
-        for (size_t i = 0; i < sizeof(cdl_param_patterns) / sizeof(cdl_param_patterns[0]); i += 2) {
-            check_and_prepend(&head, cdl_param_patterns[i], cdl_param_patterns[i + 1]);
+    if (!fix.no_param) {
+        /* Prepend the directives the netlist lacks */
+        for (size_t i = 0; i < CDL_DIRECTIVE_COUNT; i++) {
+            if (!(directives & (1u << i))) {
+                prepend_line(&lines, cdl_directives[i].prepend);
+            }
         }
     }
 
     /* Prepend header information */
-    do {
-        const char *header =
-            "************************************************************************\n"
-            "* Generated by by smic180bcd_cdl_fixer\n"
-            "* Author: Huang Rui <vowstar@gmail.com>\n"
-            "\n"
-            "* CDL parameter\n"
-            "************************************************************************\n";
-        prepend_line(&head, header);
-    }
-    while (0);
-
-    if (!no_case_conversion) {
-        /* Define cdl_case_patterns and their replacements */
-        const char *cdl_case_patterns[] = {
-            " W=", " w=",
-            " L=", " l=",
-            " AREA=", " area=",
-            " PJ=", " pj=",
-            " M=", " m=",
-            " FW=", " fw=",
-            " C=", " c=",
-            " R=", " r=",
-            " FINGERS=", " fingers=",
-        };
-
-        /* Replace substrings in the linked list */
-        replace_substrings(head, cdl_case_patterns, sizeof(cdl_case_patterns) / sizeof(cdl_case_patterns[0]));
-    }
-
-    if (!no_calc_data) {
-        /* Process the buffer to calculate cdl parameters */
-        process_list(head);
-    }
-
-    if (soc_module) {
-        /* Parse the SOC module file */
-        struct module_node *modules_head = parse_soc_mod_file(soc_module);
-        if (modules_head) {
-            /* Insert or update PININFO lines */
-            insert_pininfo(head, modules_head);
-            /* Free module information */
-            free_modules(modules_head);
-        }
-    }
-
-    /* Join the lines into a buffer */
-    buffer = join_lines(head, &length);
-    /* Output buffer to file_out */
-    fwrite(buffer, 1, length, file_out);
-    /* Free the linked list */
-    free_lines(head);
-    /* Free buffer */
-    free(buffer);
+    prepend_line(&lines, cdl_generated_header);
+
+    /* Output the lines to file_out */
+    int ret = 0;
+    if (write_lines(fileno(file_out), &lines) != 0) {
+        fprintf(stderr, "Failed to write output\n");
+        ret = 1;
+    }
+    /* Free the line list, then the module information its PININFO lines point into */
+    free_lines(&lines);
+    free_module_index(&module_index);
+    /* Release the input the lines were viewing */
+    release_input(&input_buffer);
     /* Close input file */
     if (file_in != stdin) {
         fclose(file_in);
@@ -755,5 +3501,6 @@ int main(int argc, const char *argv[]) {
         fclose(file_out);
     }
 
-    return 0;
+    return ret;
 }
+#endif
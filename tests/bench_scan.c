@@ -0,0 +1,141 @@
+/**
+ * @file bench_scan.c
+ * @brief Benchmark of the newline scanners against the strchr loop they replaced
+ *
+ * Every variant builds the same line table for a synthetic netlist; the best of
+ * BENCH_ROUNDS runs is reported.
+ */
+
+#define CDL_FIXER_NO_MAIN
+#include "smic180bcd_cdl_fixer.c"
+
+#include <time.h>
+
+#define BENCH_LINES (1000000)
+#define BENCH_ROUNDS (5)
+
+/* Function to read the monotonic clock in nanoseconds */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Function to split buffer the way split_buffer did before the scanners, with
+ * strchr and strlen, but filling the line table instead of copying every line.
+ */
+static size_t split_newlines_strchr(const char *buffer, struct line_entry *lines) {
+    size_t count = 0;
+    const char *start = buffer;
+    while (1) {
+        const char *end = strchr(start, '\n');
+        size_t length = end ? (size_t)(end - start) : strlen(start);
+        if (length > 0) {
+            lines[count].line = start;
+            lines[count].length = length;
+            count++;
+        }
+        if (!end) {
+            break;
+        }
+        start = end + 1;
+    }
+    return count;
+}
+
+/* Function to build a netlist of count lines of typical lengths, null-terminated */
+static char *make_netlist(size_t count, size_t *size) {
+    static const char *const samples[] = {
+        "MM0 net1 net2 VSS VSS n18 W=1.5u L=180n M=1\n",
+        "+ AD=0.3p AS=0.3p PD=1.9u PS=1.9u\n",
+        "XI12 A B Y VDD VSS NAND2X1\n",
+        "*.PININFO A:I B:I Y:O VDD:B VSS:B\n",
+        "\n",
+        ".SUBCKT INVX1 A Y VDD VSS\n",
+        "RR3 net7 net9 rpoly2 W=2u L=10u fingers=2 m=1\n",
+    };
+    size_t sample_count = sizeof(samples) / sizeof(samples[0]);
+
+    size_t capacity = 0;
+    for (size_t i = 0; i < count; i++) {
+        capacity += strlen(samples[i % sample_count]);
+    }
+    char *buffer = malloc(capacity + 1);
+    if (!buffer) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    char *out = buffer;
+    for (size_t i = 0; i < count; i++) {
+        out = stpcpy(out, samples[i % sample_count]);
+    }
+    *size = out - buffer;
+    return buffer;
+}
+
+/* Function to time one scanner, counting then splitting as split_buffer does */
+static void bench_scanner(const char *name, const struct line_scanner *scanner, const char *buffer, size_t size,
+                          size_t expected) {
+    uint64_t best = UINT64_MAX;
+    size_t count = 0;
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        uint64_t start = now_ns();
+        size_t max_lines = scanner->count(buffer, size) + 1;
+        struct line_entry *lines = malloc(max_lines * sizeof(struct line_entry));
+        if (!lines) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        size_t tail;
+        count = scanner->split(buffer, size, lines, &tail);
+        uint64_t elapsed = now_ns() - start;
+        free(lines);
+        if (elapsed < best) {
+            best = elapsed;
+        }
+    }
+    printf("  %-8s %8.2f ms%s\n", name, best / 1e6, count == expected ? "" : "  (wrong line count)");
+}
+
+int main(void) {
+    size_t size;
+    char *buffer = make_netlist(BENCH_LINES, &size);
+    printf("Splitting %zu bytes into lines, best of %d runs\n", size, BENCH_ROUNDS);
+
+    /* The strchr loop counts nothing first, so its table is sized from the line count */
+    uint64_t best = UINT64_MAX;
+    size_t expected = 0;
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        uint64_t start = now_ns();
+        struct line_entry *lines = malloc((BENCH_LINES + 1) * sizeof(struct line_entry));
+        if (!lines) {
+            fprintf(stderr, "Memory allocation failed\n");
+            return 1;
+        }
+        expected = split_newlines_strchr(buffer, lines);
+        uint64_t elapsed = now_ns() - start;
+        free(lines);
+        if (elapsed < best) {
+            best = elapsed;
+        }
+    }
+    printf("  %-8s %8.2f ms\n", "strchr", best / 1e6);
+
+    const struct line_scanner scalar = { count_newlines_scalar, split_newlines_scalar };
+    bench_scanner("scalar", &scalar, buffer, size, expected);
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        const struct line_scanner sse2 = { count_newlines_sse2, split_newlines_sse2 };
+        bench_scanner("sse2", &sse2, buffer, size, expected);
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        const struct line_scanner avx2 = { count_newlines_avx2, split_newlines_avx2 };
+        bench_scanner("avx2", &avx2, buffer, size, expected);
+    }
+#endif
+
+    free(buffer);
+    return 0;
+}
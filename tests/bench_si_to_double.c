@@ -0,0 +1,98 @@
+/**
+ * @file bench_si_to_double.c
+ * @brief Benchmark of si_to_double against the sscanf conversion it replaced, and strtod
+ */
+
+#define CDL_FIXER_NO_MAIN
+#include "smic180bcd_cdl_fixer.c"
+
+#include <time.h>
+
+#define BENCH_VALUES (1000000)
+#define BENCH_ROUNDS (5)
+
+/* Function to read the monotonic clock in nanoseconds */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* Function to convert an SI string the way si_to_double did before the dedicated parser */
+static double si_to_double_sscanf(const char *si_str) {
+    double value;
+    char unit[3];
+
+    if (sscanf(si_str, "%lf%2s", &value, unit) < 1) {
+        return NAN;
+    }
+
+    const struct { char *unit; double multiplier; } units[] = {
+        {"y", 1e-24}, {"z", 1e-21}, {"a", 1e-18}, {"f", 1e-15}, {"p", 1e-12},
+        {"n", 1e-9}, {"u", 1e-6}, {"m", 1e-3}, {"c", 1e-2}, {"d", 1e-1},
+        {"da", 1e1}, {"h", 1e2}, {"k", 1e3}, {"M", 1e6}, {"G", 1e9},
+        {"T", 1e12}, {"P", 1e15}, {"E", 1e18}, {"Z", 1e21}, {"Y", 1e24}
+    };
+
+    size_t num_units = sizeof(units) / sizeof(units[0]);
+    for (size_t i = 0; i < num_units; i++) {
+        if (strcmp(units[i].unit, unit) == 0) {
+            return value * units[i].multiplier;
+        }
+    }
+    return value;
+}
+
+/* Typical parameter values of a netlist */
+static const char *const samples[] = {
+    "1.5u", "180n", "0.42", "2.4333333333333335u", "10k", "1", "0.3p", "1.9u", "3.6e-7", "45f",
+};
+
+#define SAMPLE_COUNT (sizeof(samples) / sizeof(samples[0]))
+
+/* Sum of the converted values, printed so that no conversion is optimized away */
+static double checksum;
+
+/* Function to print the best time per value of one converter */
+static void report(const char *name, uint64_t best) {
+    printf("  %-12s %7.1f ns per value\n", name, (double)best / BENCH_VALUES);
+}
+
+int main(void) {
+    size_t lengths[SAMPLE_COUNT];
+    for (size_t i = 0; i < SAMPLE_COUNT; i++) {
+        lengths[i] = strlen(samples[i]);
+    }
+    printf("Converting %d values, best of %d runs\n", BENCH_VALUES, BENCH_ROUNDS);
+
+    uint64_t best_sscanf = UINT64_MAX, best_strtod = UINT64_MAX, best_si = UINT64_MAX;
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        uint64_t start = now_ns();
+        for (int i = 0; i < BENCH_VALUES; i++) {
+            checksum += si_to_double_sscanf(samples[i % SAMPLE_COUNT]);
+        }
+        uint64_t elapsed = now_ns() - start;
+        best_sscanf = elapsed < best_sscanf ? elapsed : best_sscanf;
+
+        start = now_ns();
+        for (int i = 0; i < BENCH_VALUES; i++) {
+            checksum += strtod(samples[i % SAMPLE_COUNT], NULL);
+        }
+        elapsed = now_ns() - start;
+        best_strtod = elapsed < best_strtod ? elapsed : best_strtod;
+
+        start = now_ns();
+        for (int i = 0; i < BENCH_VALUES; i++) {
+            size_t consumed;
+            checksum += si_to_double(samples[i % SAMPLE_COUNT], lengths[i % SAMPLE_COUNT], &consumed);
+        }
+        elapsed = now_ns() - start;
+        best_si = elapsed < best_si ? elapsed : best_si;
+    }
+
+    report("sscanf", best_sscanf);
+    report("strtod", best_strtod);
+    report("si_to_double", best_si);
+    printf("  (checksum %g)\n", checksum);
+    return 0;
+}
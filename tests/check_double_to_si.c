@@ -0,0 +1,150 @@
+/**
+ * @file check_double_to_si.c
+ * @brief Check that double_to_si writes the fewest digits that read back as the value
+ *
+ * The shortest digit count is found independently with snprintf and strtod: for
+ * each count, the value rounded to that many digits and the numbers one unit in
+ * the last place either side are read back. Every string double_to_si writes has
+ * to read back exactly with si_to_double and have that many significant digits.
+ */
+
+#define CDL_FIXER_NO_MAIN
+#include "smic180bcd_cdl_fixer.c"
+
+#define RANDOM_CASES (200000)
+
+static uint64_t random_state = 0x2545f4914f6cdd1dULL;
+
+/* Function to draw the next number of a xorshift64* sequence, fixed for reproducible runs */
+static uint64_t next_random(void) {
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 2685821657736338717ULL;
+}
+
+/* Function to count the digits of a number without its trailing zeros */
+static int trimmed_digit_count(uint64_t number) {
+    while (number && number % 10 == 0) {
+        number /= 10;
+    }
+    int count = 1;
+    while (number >= 10) {
+        number /= 10;
+        count++;
+    }
+    return count;
+}
+
+/* Function to find the fewest significant digits that strtod reads back as value */
+static int shortest_digit_count(double value) {
+    for (int count = 1; count < MAX_SIGNIFICANT_DIGITS; count++) {
+        char text[MAX_SI_LENGTH], candidate[MAX_SI_LENGTH];
+        snprintf(text, sizeof(text), "%.*e", count - 1, value);
+
+        /* The printed digits as an integer, and the exponent of the last one */
+        uint64_t mantissa = 0;
+        const char *p = text;
+        for (; *p != 'e'; p++) {
+            if (*p != '.') {
+                mantissa = mantissa * 10 + (*p - '0');
+            }
+        }
+        int exponent = atoi(p + 1) - count + 1;
+
+        int best = 0;
+        for (int delta = -1; delta <= 1; delta++) {
+            snprintf(candidate, sizeof(candidate), "%" PRIu64 "e%d", mantissa + delta, exponent);
+            if (strtod(candidate, NULL) == value) {
+                int digits = trimmed_digit_count(mantissa + delta);
+                best = !best || digits < best ? digits : best;
+            }
+        }
+        if (best) {
+            return best;
+        }
+    }
+    return MAX_SIGNIFICANT_DIGITS;
+}
+
+/* Function to count the significant digits of a string written by double_to_si */
+static int significant_digit_count(const char *text) {
+    char digits[MAX_SI_LENGTH];
+    int count = 0;
+    for (const char *p = text; *p && *p != 'e' && !is_ascii_letter(*p); p++) {
+        if (is_ascii_digit(*p) && (count || *p != '0')) {
+            digits[count++] = *p;
+        }
+    }
+    while (count > 1 && digits[count - 1] == '0') {
+        count--;
+    }
+    return count;
+}
+
+/* Function to check the shortest string of a positive value. Returns 0 if it is right, otherwise 1. */
+static int check_shortest(double value) {
+    char text[MAX_SI_LENGTH + 1];
+    *double_to_si(text, value, 0) = '\0';
+
+    size_t consumed;
+    double parsed = si_to_double(text, strlen(text), &consumed);
+    if (parsed != value || consumed != strlen(text)) {
+        fprintf(stderr, "%.17g: \"%s\" reads back as %.17g\n", value, text, parsed);
+        return 1;
+    }
+    int expected = shortest_digit_count(value);
+    if (significant_digit_count(text) != expected) {
+        fprintf(stderr, "%.17g: \"%s\" is not the shortest, %d digits are enough\n", value, text, expected);
+        return 1;
+    }
+    return 0;
+}
+
+/* Function to check the string of value rounded to sig_digits. Returns 0 if it is expected, otherwise 1. */
+static int check_rounded(double value, int sig_digits, const char *expected) {
+    char text[MAX_SI_LENGTH + 1];
+    *double_to_si(text, value, sig_digits) = '\0';
+    if (strcmp(text, expected) == 0) {
+        return 0;
+    }
+    fprintf(stderr, "%.17g to %d digits: got \"%s\", expected \"%s\"\n", value, sig_digits, text, expected);
+    return 1;
+}
+
+int main(void) {
+    int failures = 0;
+
+    /* Values that once got more digits than needed */
+    failures += check_shortest(8.636023410160205e-10);
+    failures += check_shortest(0x1p-24);
+
+    /* Powers of two and their neighbours, within the exact range and beyond it */
+    for (int exponent = -200; exponent <= 200 && failures < 20; exponent++) {
+        double power = ldexp(1.0, exponent);
+        failures += check_shortest(power);
+        failures += check_shortest(nextafter(power, 0));
+        failures += check_shortest(nextafter(power, INFINITY));
+    }
+
+    /* Random values from 1e-40 to 1e40, uniform in their exponent */
+    for (int i = 0; i < RANDOM_CASES && failures < 20; i++) {
+        double value = pow(10.0, (double)(next_random() >> 11) / (1ULL << 53) * 80 - 40);
+        failures += check_shortest(value);
+    }
+
+    /* Rounding to a number of significant digits */
+    failures += check_rounded(2.4333333333333335e-6, 6, "2.43333u");
+    failures += check_rounded(9.9999996e-7, 6, "1u");
+    failures += check_rounded(-1.5e-6, 3, "-1.5u");
+    failures += check_rounded(1.23456789e-20, 3, "1.23e-20");
+    failures += check_rounded(9.996e20, 3, "1e21");
+
+    if (failures) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("check_double_to_si: powers of two and %d random values are the shortest that round trip\n",
+           RANDOM_CASES);
+    return 0;
+}
@@ -0,0 +1,81 @@
+/**
+ * @file check_params.c
+ * @brief Check that device statements get their calculated data whatever their pair count
+ */
+
+#define CDL_FIXER_NO_MAIN
+#include "smic180bcd_cdl_fixer.c"
+
+/* Function to write count pairs <prefix><i>=1 to out, returns the end */
+static char *write_pairs(char *out, const char *prefix, int count) {
+    for (int i = 0; i < count; i++) {
+        out += sprintf(out, " %s%d=1", prefix, i);
+    }
+    return out;
+}
+
+/*
+ * Function to process the statement of count lines and compare the end of its
+ * last line with expected. Returns 0 if it matches, otherwise 1.
+ */
+static int check_statement(const char *name, char *const lines[], size_t count, const char *expected) {
+    struct line_entry segments[8];
+    struct geometry_cache cache;
+    struct arena arena = { .head = NULL };
+    for (size_t i = 0; i < count; i++) {
+        segments[i].line = lines[i];
+        segments[i].length = strlen(lines[i]);
+    }
+    geometry_cache_init(&cache);
+    process_statement(segments, count, 0, &cache, &arena);
+
+    const struct line_entry *last = &segments[count - 1];
+    size_t expected_length = strlen(expected);
+    int failed = last->length < expected_length ||
+                 memcmp(last->line + last->length - expected_length, expected, expected_length) != 0;
+    if (failed) {
+        fprintf(stderr, "%s: expected the line to end with \"%s\", got \"%.*s\"\n", name, expected,
+                (int)last->length, last->line);
+    }
+    geometry_cache_free(&cache);
+    arena_release(&arena);
+    return failed;
+}
+
+int main(void) {
+    static char first[4096], second[4096];
+    int failures = 0;
+
+    /* Geometry keys after 64 other pairs on one line */
+    char *out = stpcpy(first, "XI0 a b cell");
+    out = write_pairs(out, "p", 64);
+    strcpy(out, " w=1u l=1u");
+    failures += check_statement("64 pairs, then w and l", (char *[]){ first }, 1, "w=1u l=1u fw=1u");
+
+    /* Geometry keys spread over a continuation line, the first w winning */
+    out = stpcpy(first, "XI1 a b cell w=2u");
+    write_pairs(out, "p", 60);
+    out = stpcpy(second, "+");
+    out = write_pairs(out, "q", 60);
+    strcpy(out, " l=1u fingers=2 w=9u");
+    failures += check_statement("pairs over two lines", (char *[]){ first, second }, 2, "w=9u fw=1u");
+
+    /* Area and pj after many pairs */
+    out = stpcpy(first, "DD0 a b ndio");
+    out = write_pairs(out, "p", 100);
+    strcpy(out, " area=8 pj=12");
+    failures += check_statement("100 pairs, then area and pj", (char *[]){ first }, 1, "pj=12 w=2 l=4");
+
+    /* Nothing to calculate without both w and l */
+    out = stpcpy(first, "MM0 d g s b nch");
+    out = write_pairs(out, "p", 80);
+    strcpy(out, " w=1u");
+    failures += check_statement("w without l", (char *[]){ first }, 1, "p79=1 w=1u");
+
+    if (failures) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("check_params: all checks passed\n");
+    return 0;
+}
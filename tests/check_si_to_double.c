@@ -0,0 +1,166 @@
+/**
+ * @file check_si_to_double.c
+ * @brief Differential test of si_to_double against strtod
+ *
+ * Random SPICE numbers are converted by si_to_double and, with the scale factor
+ * folded into the exponent, by strtod. Both the value, to the bit, and the number
+ * of bytes consumed have to agree.
+ */
+
+#define CDL_FIXER_NO_MAIN
+#include "smic180bcd_cdl_fixer.c"
+
+#define RANDOM_CASES (1000000)
+
+/* Scale factors with their exponent, "mil" written as 0 and applied as a factor */
+static const struct {
+    const char *text;
+    int exponent;
+} scales[] = {
+    { "", 0 }, { "T", 12 }, { "G", 9 }, { "MEG", 6 }, { "K", 3 }, { "MIL", 0 },
+    { "M", -3 }, { "U", -6 }, { "N", -9 }, { "P", -12 }, { "F", -15 }, { "A", -18 },
+};
+
+#define SCALE_COUNT (sizeof(scales) / sizeof(scales[0]))
+#define MIL_SCALE (5)
+
+static uint64_t random_state = 0x9e3779b97f4a7c15ULL;
+
+/* Function to draw the next number of a xorshift64* sequence, fixed for reproducible runs */
+static uint64_t next_random(void) {
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 2685821657736338717ULL;
+}
+
+/* Function to draw a number below bound */
+static int random_below(int bound) {
+    return (int)(next_random() % (uint64_t)bound);
+}
+
+/* Function to tell whether two doubles are the same value, NaN matching NaN and -0 not matching 0 */
+static bool same_double(double a, double b) {
+    if (isnan(a) || isnan(b)) {
+        return isnan(a) && isnan(b);
+    }
+    return a == b && signbit(a) == signbit(b);
+}
+
+/*
+ * Function to convert text with si_to_double and compare with expected and
+ * expected_consumed. Returns 0 if both agree, otherwise 1.
+ */
+static int check_conversion(const char *text, double expected, size_t expected_consumed) {
+    size_t consumed;
+    double value = si_to_double(text, strlen(text), &consumed);
+    if (same_double(value, expected) && consumed == expected_consumed) {
+        return 0;
+    }
+    fprintf(stderr, "\"%s\": got %.17g with %zu bytes consumed, expected %.17g with %zu\n", text, value, consumed,
+            expected, expected_consumed);
+    return 1;
+}
+
+/* Function to write a random decimal mantissa to out, returns the end */
+static char *write_mantissa(char *out) {
+    if (random_below(4) == 0) {
+        *out++ = random_below(2) ? '-' : '+';
+    }
+    int integer_digits = random_below(4) ? random_below(6) : random_below(25);
+    int fraction_digits = random_below(3) ? random_below(8) : random_below(25);
+    if (!integer_digits && !fraction_digits) {
+        integer_digits = 1;
+    }
+    for (int i = 0; i < integer_digits; i++) {
+        /* Leading zeros now and then, they are not significant */
+        *out++ = (char)('0' + (i == 0 && random_below(4) ? 1 + random_below(9) : random_below(10)));
+    }
+    if (fraction_digits || random_below(8) == 0) {
+        *out++ = '.';
+    }
+    for (int i = 0; i < fraction_digits; i++) {
+        *out++ = (char)('0' + random_below(10));
+    }
+    return out;
+}
+
+/* Function to lower a random selection of the letters of text */
+static void mix_case(char *text) {
+    for (; *text; text++) {
+        if (random_below(2)) {
+            *text = (char)(*text | 0x20);
+        }
+    }
+}
+
+/* Function to check one random SPICE number. Returns 0 if it converts like strtod, otherwise 1. */
+static int check_random_number(void) {
+    char text[128], reference[128];
+    char *out = write_mantissa(text);
+    size_t mantissa_length = out - text;
+
+    int exponent = 0;
+    if (random_below(3) == 0) {
+        exponent = random_below(4) ? random_below(61) - 30 : random_below(801) - 400;
+        out += sprintf(out, "%c%d", random_below(2) ? 'e' : 'E', exponent);
+    }
+
+    size_t scale = random_below(2) ? (size_t)random_below(SCALE_COUNT) : 0;
+    char *scale_text = out;
+    out = stpcpy(out, scales[scale].text);
+    *out = '\0';
+    mix_case(scale_text);
+    if (scale && random_below(4) == 0) {
+        out = stpcpy(out, random_below(2) ? "m" : "Hz"); /* Unit letters after the scale factor */
+    }
+    size_t consumed = out - text;
+    if (random_below(4) == 0) {
+        out = stpcpy(out, random_below(2) ? " " : ")"); /* Text after the number */
+    }
+    *out = '\0';
+
+    /* The same number for strtod, the scale factor folded into the exponent */
+    memcpy(reference, text, mantissa_length);
+    sprintf(reference + mantissa_length, "e%d", exponent + scales[scale].exponent);
+    double expected = strtod(reference, NULL);
+    if (scale == MIL_SCALE) {
+        expected *= 25.4e-6;
+    }
+    return check_conversion(text, expected, consumed);
+}
+
+int main(void) {
+    int failures = 0;
+
+    /* Edge cases, with the bytes a number ends at */
+    failures += check_conversion("0", 0.0, 1);
+    failures += check_conversion("-0", -0.0, 2);
+    failures += check_conversion(".5", 0.5, 2);
+    failures += check_conversion("5.", 5.0, 2);
+    failures += check_conversion("1.2.3", 1.2, 3);
+    failures += check_conversion("1e", 1.0, 2);
+    failures += check_conversion("1e+", 1.0, 2);
+    failures += check_conversion("2e-3x", 2e-3, 5);
+    failures += check_conversion("10meg", 10e6, 5);
+    failures += check_conversion("10um", 10e-6, 4);
+    failures += check_conversion("1me", 1e-3, 3);
+    failures += check_conversion("4.9e-324", strtod("4.9e-324", NULL), 8);
+    failures += check_conversion("1e400", INFINITY, 5);
+    failures += check_conversion("12345678901234567890123", 12345678901234567890123.0, 23);
+    failures += check_conversion("", NAN, 0);
+    failures += check_conversion(".", NAN, 0);
+    failures += check_conversion("-", NAN, 0);
+    failures += check_conversion("u", NAN, 0);
+
+    for (int i = 0; i < RANDOM_CASES && failures < 20; i++) {
+        failures += check_random_number();
+    }
+
+    if (failures) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("check_si_to_double: %d random numbers agree with strtod\n", RANDOM_CASES);
+    return 0;
+}